@@ -0,0 +1,564 @@
+// Benchmarks for cow containers.
+// Build: g++ -O2 -std=c++14 -pthread benchmark.cpp -o benchmark
+// Usage: benchmark [name filter] [milliseconds per run]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cow.h"
+
+namespace
+{
+    struct A
+    {
+        int value = 0;
+
+        A(int v) : value(v) {}
+    };
+
+    struct pod256
+    {
+        int value;
+        char payload[256 - sizeof(int)];
+    };
+
+    template <typename T> struct values;
+
+    template <> struct values<int>
+    {
+        static const char* name() { return "int"; }
+        static int make(int i) { return i; }
+        static int key(int v) { return v; }
+    };
+
+    template <> struct values<std::shared_ptr<A>>
+    {
+        static const char* name() { return "shared_ptr<A>"; }
+        static std::shared_ptr<A> make(int i) { return std::make_shared<A>(i); }
+        static int key(const std::shared_ptr<A>& v) { return v->value; }
+    };
+
+    template <> struct values<pod256>
+    {
+        static const char* name() { return "pod256"; }
+        static pod256 make(int i) { pod256 v; v.value = i; std::memset(v.payload, 0, sizeof(v.payload)); return v; }
+        static int key(const pod256& v) { return v.value; }
+    };
+
+    template <typename T, typename TLock = std::mutex, typename TReadMode = cow::locked_reads>
+    using vector_of = cow::vector<T, TLock, std::lock_guard<TLock>, std::allocator<T>, TReadMode>;
+
+#if defined(__cpp_lib_shared_mutex)
+    typedef std::shared_mutex shared_mutex;
+#else
+    typedef std::shared_timed_mutex shared_mutex;
+#endif
+
+    typedef std::chrono::steady_clock clock;
+
+    const char* filter = "";
+    std::chrono::milliseconds duration(200);
+    volatile long sink = 0; // keeps results of reads alive
+
+    bool enabled(const std::string& name)
+    {
+        return name.find(filter) != std::string::npos;
+    }
+
+    void report(const std::string& name, int threads, double ops, double seconds)
+    {
+        std::printf("%-64s %3d thr %12.1f ns/op %14.0f ops/s\n", name.c_str(), threads, seconds * 1e9 / ops * threads, ops / seconds);
+    }
+
+    // Runs body(thread index, stop flag) returning number of operations on each thread for duration
+    template <typename F>
+    void run_threads(const std::string& name, int threads, F body)
+    {
+        std::atomic<bool> stop(false);
+        std::atomic<long> ops(0);
+        std::vector<std::thread> workers;
+
+        clock::time_point start = clock::now();
+        for (int i = 0; i < threads; ++i)
+            workers.emplace_back([&, i] { ops += body(i, stop); });
+
+        std::this_thread::sleep_for(duration);
+        stop = true;
+        for (auto& worker : workers)
+            worker.join();
+
+        report(name, threads, double(ops), std::chrono::duration<double>(clock::now() - start).count());
+    }
+
+    template <typename V>
+    void fill(V& v, int size)
+    {
+        typedef typename V::value_type T;
+        for (int i = 0; i < size; ++i)
+            v.push_back(values<T>::make(i));
+    }
+
+    // push_back when nobody holds read-only copy versus push_back while the previous state is pinned by a snapshot
+    template <typename V>
+    void bench_push_back(const std::string& backend, int size)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = "push_back/in_place/" + backend + "/" + values<T>::name() + "/" + std::to_string(size);
+        if (enabled(name))
+        {
+            double ops = 0;
+            clock::time_point start = clock::now();
+            while (clock::now() - start < duration)
+            {
+                V v;
+                fill(v, size);
+                ops += size;
+            }
+            report(name, 1, ops, std::chrono::duration<double>(clock::now() - start).count());
+        }
+
+        name = "push_back/copy/" + backend + "/" + values<T>::name() + "/" + std::to_string(size);
+        if (enabled(name))
+        {
+            V base;
+            fill(base, size);
+
+            double ops = 0;
+            clock::time_point start = clock::now();
+            while (clock::now() - start < duration)
+            {
+                V v(base);
+                for (int i = 0; i < 100; ++i)
+                {
+                    auto snapshot = v.read_only_copy();
+                    v.push_back(values<T>::make(i));
+                }
+                ops += 100;
+            }
+            report(name, 1, ops, std::chrono::duration<double>(clock::now() - start).count());
+        }
+    }
+
+    // Snapshot acquisition from many threads, with or without a concurrent writer
+    template <typename V>
+    void bench_snapshot(const std::string& backend, int threads, bool with_writer)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = std::string("read_only_copy/") + (with_writer ? "with_writer/" : "readers/") + backend + "/" + values<T>::name();
+        if (!enabled(name))
+            return;
+
+        V v;
+        fill(v, 64);
+
+        std::atomic<bool> stop_writer(false);
+        std::thread writer;
+        if (with_writer)
+            writer = std::thread([&] {
+                for (int i = 0; !stop_writer; ++i)
+                {
+                    v.push_back(values<T>::make(i));
+                    v.removeFirst([](const T&) { return true; });
+                }
+            });
+
+        run_threads(name, threads, [&](int, std::atomic<bool>& stop) {
+            long ops = 0, sum = 0;
+            for (; !stop; ++ops)
+                sum += long(v.read_only_copy().size());
+            sink = sink + sum;
+            return ops;
+        });
+
+        stop_writer = true;
+        if (writer.joinable())
+            writer.join();
+    }
+
+    // Snapshot access through cached_reader, the vector is changed rarely
+    template <typename V>
+    void bench_cached(const std::string& backend, int threads)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = "cached_reader/" + backend + "/" + values<T>::name();
+        if (!enabled(name))
+            return;
+
+        V v;
+        fill(v, 64);
+
+        run_threads(name, threads, [&](int thread, std::atomic<bool>& stop) {
+            cow::cached_reader<V> reader(v);
+            long ops = 0, sum = 0;
+            for (; !stop; ++ops)
+            {
+                if (thread == 0 && ops % 100000 == 0)
+                    v.push_back(values<T>::make(int(ops)));
+                sum += long(reader->size());
+            }
+            sink = sink + sum;
+            return ops;
+        });
+    }
+
+    // Concurrent push_back from many threads while a reader keeps taking snapshots,
+    // directly, through combining_writer or through async_writer
+    template <typename V>
+    void bench_producers(const std::string& backend, int threads, const std::string& mode)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = "producers/" + mode + "/" + backend + "/" + values<T>::name();
+        if (!enabled(name))
+            return;
+
+        V v;
+        cow::combining_writer<V> combining(v);
+        cow::async_writer<V> async(v);
+
+        std::atomic<bool> stop_reader(false);
+        std::thread reader([&] {
+            long sum = 0;
+            while (!stop_reader)
+                sum += long(v.read_only_copy().size());
+            sink = sink + sum;
+        });
+
+        run_threads(name, threads, [&](int thread, std::atomic<bool>& stop) {
+            long ops = 0;
+            for (; !stop; ++ops)
+            {
+                if (mode == "combining")
+                    combining.push_back(values<T>::make(thread));
+                else if (mode == "async")
+                    async.push_back(values<T>::make(thread));
+                else
+                    v.push_back(values<T>::make(thread));
+
+                if (ops % 1000 == 999 && thread == 0) // keep the size bounded
+                    v.clear();
+            }
+            return ops;
+        });
+
+        stop_reader = true;
+        reader.join();
+    }
+
+    // Mixed load: each thread iterates a snapshot or writes, writes_per_1000 of operations are writes
+    template <typename V>
+    void bench_mixed(const std::string& backend, int threads, int writes_per_1000)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = "mixed/" + std::to_string(writes_per_1000) + "w/" + backend + "/" + values<T>::name();
+        if (!enabled(name))
+            return;
+
+        V v;
+        fill(v, 1000);
+
+        run_threads(name, threads, [&](int thread, std::atomic<bool>& stop) {
+            long ops = 0, sum = 0;
+            unsigned seed = unsigned(thread) * 7919u + 1;
+            for (; !stop; ++ops)
+            {
+                seed = seed * 1103515245u + 12345u;
+                if ((seed >> 8) % 1000 < unsigned(writes_per_1000))
+                {
+                    v.push_back(values<T>::make(int(ops)));
+                    v.removeFirst([](const T&) { return true; });
+                }
+                else
+                    for (auto const& elem : v.read_only_copy())
+                        sum += values<T>::key(elem);
+            }
+            sink = sink + sum;
+            return ops;
+        });
+    }
+
+    // remove(predicate) of 30% elements, in place or while a snapshot holds the storage
+    template <typename V>
+    void bench_remove(const std::string& backend, int size, bool pinned, bool scattered = false)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = std::string("remove/") + (scattered ? "scattered/" : "") + (pinned ? "copy/" : "in_place/") + backend + "/" + values<T>::name() + "/" + std::to_string(size);
+        if (!enabled(name))
+            return;
+
+        // push_back into atomic_reads vectors copies every time, so the content is assigned at once
+        std::vector<T> content;
+        for (int i = 0; i < size; ++i)
+            content.push_back(values<T>::make(i));
+
+        V base;
+        base.assign(std::vector<T>(content));
+
+        double ops = 0, seconds = 0;
+        clock::time_point end = clock::now() + duration;
+        while (clock::now() < end)
+        {
+            V v;
+            v.assign(std::vector<T>(content));
+            auto snapshot = base.read_only_copy();
+            if (pinned)
+                snapshot = v.read_only_copy();
+
+            clock::time_point start = clock::now();
+            if (scattered) // unpredictable matches
+                sink = sink + long(v.remove([](const T& elem) { return (unsigned(values<T>::key(elem)) * 2654435761u >> 16) % 10 < 3; }));
+            else
+                sink = sink + long(v.remove([](const T& elem) { return values<T>::key(elem) % 10 < 3; }));
+            seconds += std::chrono::duration<double>(clock::now() - start).count();
+            ops += size;
+        }
+        report(name, 1, ops, seconds);
+    }
+
+    // Search of a missing key in a large snapshot with a lambda and with a vectorized predicate
+    void bench_search(int size)
+    {
+        vector_of<int> v;
+        fill(v, size);
+
+        auto run = [&](const std::string& name, std::function<long()> search) {
+            if (!enabled(name))
+                return;
+
+            double ops = 0;
+            clock::time_point start = clock::now();
+            while (clock::now() - start < duration)
+            {
+                sink = sink + search();
+                ops += size;
+            }
+            report(name, 1, ops, std::chrono::duration<double>(clock::now() - start).count());
+        };
+
+        std::string suffix = "/" + std::to_string(size);
+        run("count_if/lambda" + suffix, [&] { return long(v.count_if([](int elem) { return elem == -1; })); });
+        run("count_if/equals" + suffix, [&] { return long(v.count_if(cow::equals(-1))); });
+        run("exists/lambda" + suffix, [&] { return long(v.exists([](int elem) { return elem == -1; })); });
+        run("exists/equals" + suffix, [&] { return long(v.exists(cow::equals(-1))); });
+        run("exists/in_range" + suffix, [&] { return long(v.exists(cow::in_range(-10, -1))); });
+    }
+
+    // std:: algorithm over the vector's own iterators and over iterators of a read-only copy
+    void bench_iterate(int size)
+    {
+        vector_of<int> v;
+        fill(v, size);
+
+        auto run = [&](const std::string& name, std::function<long()> scan) {
+            if (!enabled(name))
+                return;
+
+            double ops = 0;
+            clock::time_point start = clock::now();
+            while (clock::now() - start < duration)
+            {
+                sink = sink + scan();
+                ops += size;
+            }
+            report(name, 1, ops, std::chrono::duration<double>(clock::now() - start).count());
+        };
+
+        std::string suffix = "/" + std::to_string(size);
+        run("iterate/iterator" + suffix, [&] { return long(std::count(v.begin(), v.end(), -1)); });
+        run("iterate/read_only_copy" + suffix, [&] {
+            auto snapshot = v.read_only_copy();
+            return long(std::count(snapshot.begin(), snapshot.end(), -1));
+        });
+    }
+
+    // Point updates with update_at: in place, or while a snapshot is held (whole copy for vector,
+    // path copy for persistent_vector)
+    template <typename V>
+    void bench_update(const std::string& backend, int size, bool pinned)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = std::string("update_at/") + (pinned ? "copy/" : "in_place/") + backend + "/" + values<T>::name() + "/" + std::to_string(size);
+        if (!enabled(name))
+            return;
+
+        V v;
+        for (int i = 0; i < size; ++i)
+            v.push_back(values<T>::make(i));
+
+        double ops = 0;
+        clock::time_point start = clock::now();
+        for (int i = 0; clock::now() - start < duration; ++i)
+        {
+            auto snapshot = v.read_only_copy();
+            if (!pinned)
+                snapshot = V().read_only_copy();
+
+            for (int j = 0; j < 100; ++j, ++ops)
+                v.update_at(std::size_t(i * 100 + j) % std::size_t(size), [i](T& elem) { elem = values<T>::make(i); });
+        }
+        report(name, 1, ops, std::chrono::duration<double>(clock::now() - start).count());
+    }
+
+    // Snapshots of short lists (e.g. listeners of a connection) with heap storage versus inline elements of small_vector
+    template <typename V>
+    void bench_small(const std::string& backend, int threads, int size)
+    {
+        typedef typename V::value_type T;
+
+        std::string name = "small_list/" + backend + "/" + std::to_string(size) + "/" + values<T>::name();
+        if (!enabled(name))
+            return;
+
+        V v;
+        for (int i = 0; i < size; ++i)
+            v.push_back(values<T>::make(i));
+
+        run_threads(name, threads, [&](int, std::atomic<bool>& stop) {
+            long ops = 0, sum = 0;
+            for (; !stop; ++ops)
+                sum += long(v.read_only_copy().size());
+            sink = sink + sum;
+            return ops;
+        });
+    }
+
+    // Lookup of a key in a table, linear find_first versus binary search of sorted_vector
+    void bench_lookup(int size)
+    {
+        std::vector<int> keys;
+        for (int i = 0; i < size; ++i)
+            keys.push_back(i * 2);
+
+        vector_of<int> v;
+        v.assign(std::vector<int>(keys));
+        cow::sorted_vector<int> sorted;
+        sorted.insert_many(keys);
+
+        auto run = [&](const std::string& name, std::function<long(int)> lookup) {
+            if (!enabled(name))
+                return;
+
+            double ops = 0;
+            clock::time_point start = clock::now();
+            for (int i = 0; clock::now() - start < duration; ++i)
+            {
+                sink = sink + lookup(i % (size * 2));
+                ops += 1;
+            }
+            report(name, 1, ops, std::chrono::duration<double>(clock::now() - start).count());
+        };
+
+        std::string suffix = "/" + std::to_string(size);
+        run("lookup/find_first" + suffix, [&](int key) { return long(v.find_first(cow::equals(key), -1)); });
+        run("lookup/sorted_vector" + suffix, [&](int key) { return long(sorted.find(key, -1)); });
+
+        cow::unordered_map<int, int> map;
+        for (int key : keys)
+            map.insert(key, key);
+        run("lookup/unordered_map" + suffix, [&](int key) { return long(map.find(key, -1)); });
+
+        // a write while a snapshot is held copies the whole vector, but only touched groups of the map
+        run("insert_pinned/sorted_vector" + suffix, [&](int key) {
+            auto snapshot = sorted.read_only_copy();
+            return long(sorted.insert(key | 1) + sorted.erase(key | 1));
+        });
+        run("insert_pinned/unordered_map" + suffix, [&](int key) {
+            auto snapshot = map.read_only_copy();
+            return long(map.insert(key | 1, key) + map.erase(key | 1));
+        });
+    }
+
+    template <typename T, typename TLock, typename TReadMode>
+    void bench_vector(const std::string& backend)
+    {
+        typedef vector_of<T, TLock, TReadMode> V;
+
+        bench_push_back<V>(backend, 1000);
+        bench_remove<V>(backend, 200000, false);
+        bench_remove<V>(backend, 200000, true);
+        bench_remove<V>(backend, 200000, false, true);
+        bench_remove<V>(backend, 200000, true, true);
+
+        for (int threads = 1; threads <= 64; threads *= 2)
+        {
+            bench_snapshot<V>(backend, threads, false);
+            bench_snapshot<V>(backend, threads, true);
+            bench_cached<V>(backend, threads);
+        }
+
+        for (int threads : { 1, 4, 16, 64 })
+        {
+            bench_mixed<V>(backend, threads, 1);
+            bench_mixed<V>(backend, threads, 100);
+        }
+
+        for (int threads : { 1, 8, 32 })
+        {
+            bench_producers<V>(backend, threads, "direct");
+            bench_producers<V>(backend, threads, "combining");
+            bench_producers<V>(backend, threads, "async");
+        }
+    }
+
+    template <typename T>
+    void bench_type()
+    {
+        bench_vector<T, std::mutex, cow::locked_reads>("mutex");
+        bench_vector<T, cow::spin_lock, cow::locked_reads>("spin_lock");
+        bench_vector<T, shared_mutex, cow::locked_reads>("shared_mutex");
+        bench_vector<T, std::mutex, cow::atomic_reads>("mutex+atomic_reads");
+        bench_vector<T, cow::spin_lock, cow::atomic_reads>("spin_lock+atomic_reads");
+        bench_vector<T, std::mutex, cow::replicated_reads<2>>("mutex+replicated_reads");
+
+        // single-threaded only
+        bench_push_back<vector_of<T, cow::null_lock>>("null_lock", 1000);
+        bench_remove<vector_of<T, cow::null_lock>>("null_lock", 200000, false);
+
+        bench_push_back<cow::persistent_vector<T>>("persistent", 1000);
+
+        for (bool pinned : { false, true })
+        {
+            bench_update<vector_of<T>>("mutex", 100000, pinned);
+            bench_update<cow::persistent_vector<T>>("persistent", 100000, pinned);
+        }
+
+        for (int threads : { 1, 4, 16, 64 })
+        {
+            bench_mixed<cow::sharded_vector<T, 8>>("sharded8", threads, 1);
+            bench_mixed<cow::sharded_vector<T, 8>>("sharded8", threads, 100);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+    if (argc > 2)
+        duration = std::chrono::milliseconds(std::atoi(argv[2]));
+
+    bench_search(1000000);
+    bench_lookup(10000);
+    bench_iterate(1000);
+    for (int threads : { 1, 4 })
+        for (int size : { 0, 3 })
+        {
+            bench_small<cow::vector<int, cow::spin_lock>>("vector", threads, size);
+            bench_small<cow::small_vector<int, 4, cow::spin_lock>>("small_vector", threads, size);
+        }
+    bench_type<int>();
+    bench_type<std::shared_ptr<A>>();
+    bench_type<pod256>();
+
+    return 0;
+}
@@ -1,172 +1,5234 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <memory>
+#include <new>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
 #include <algorithm>
+#include <array>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#endif
+
+// Overloads with execution policies are available when <execution> is included before this header
+// (with libstdc++ it requires linking TBB)
+#if defined(__cpp_lib_execution)
+#include <execution>
+#endif
 
 namespace cow
 {
+    namespace detail
+    {
+        // Hint for the CPU that it's a spin-wait loop
+        inline void cpu_relax()
+        {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+            _mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+            __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+            __asm__ __volatile__("yield");
+#endif
+        }
+    }
+
     /**
-     * This is copy on write vector implmentation with short synchronizations.
-     * Read operations take a copy with short blocking just to get a copy.
-     * Write operations are synchronized and it makes a copy of data if somebody keeps readonly copy.
-     *
-     * @author Alexander Kozlov
+     * Test and test-and-set spin lock with exponential backoff. Critical sections of vector readers
+     * are a few instructions, where spinning is cheaper than a futex round-trip of std::mutex.
+     * Waiters spin on a plain load, so they don't bounce the cache line until the lock looks free.
      */
-    template <typename T, typename TLock = std::mutex, typename TLocker = std::lock_guard<TLock>, typename TAlloc = std::allocator<T>>
-    class vector
+    class spin_lock
     {
+    public:
+        spin_lock() = default;
+        spin_lock(const spin_lock&) = delete;
+        spin_lock& operator=(const spin_lock&) = delete;
+
+        void lock()
+        {
+            unsigned spins = 1;
+            while (!try_lock())
+            {
+                while (_locked.load(std::memory_order_relaxed))
+                {
+                    if (spins <= MaxSpins)
+                    {
+                        for (unsigned i = 0; i < spins; ++i)
+                            detail::cpu_relax();
+                        spins *= 2;
+                    }
+                    else // the owner is probably preempted
+                        std::this_thread::yield();
+                }
+            }
+        }
+
+        bool try_lock()
+        {
+            return !_locked.load(std::memory_order_relaxed) && !_locked.exchange(true, std::memory_order_acquire);
+        }
+
+        void unlock()
+        {
+            _locked.store(false, std::memory_order_release);
+        }
+
     private:
-        typedef vector<T, TLock, TLocker> TVector;
-        typedef std::vector<T, TAlloc> TStorage;
-        typedef std::shared_ptr<TStorage> TStoragePtr;
+        static const unsigned MaxSpins = 64;
+
+        std::atomic<bool> _locked{false};
+    };
+
+    // Lock for single-threaded builds, it does nothing.
+    struct null_lock
+    {
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+    };
+
+    // Locker for pure snapshot reads: std::shared_lock if TLock supports shared locking
+    // (std::shared_mutex, std::shared_timed_mutex and etc.), otherwise TLocker.
+    template <typename TLock, typename TLocker, typename = void>
+    struct read_locker
+    {
+        typedef TLocker type;
+    };
+
+    template <typename TLock, typename TLocker>
+    struct read_locker<TLock, TLocker, decltype(std::declval<TLock&>().lock_shared(), void())>
+    {
+        typedef std::shared_lock<TLock> type;
+    };
+
+    // Distance which keeps objects from false sharing
+#if defined(__cpp_lib_hardware_interference_size) && !defined(__GNUC__)
+    static const std::size_t cache_line_size = std::hardware_destructive_interference_size;
+#else
+    static const std::size_t cache_line_size = 64;
+#endif
+
+    // Read mode: readers copy the storage pointer under TLock (default).
+    struct locked_reads {};
+
+    // Read mode: the storage pointer is published atomically, so taking a snapshot never blocks on writers.
+    // Writers still serialize on TLock, but always make a copy, because a reader can pick up the storage at any moment.
+    struct atomic_reads {};
+
+    // Read mode of vector: as atomic_reads, but readers are split into Groups (one per NUMA node, see set_read_group).
+    // Every write copies the storage for each group with the group's allocator (see read_group_allocator),
+    // snapshots of a group touch only its replica, so readers of different groups share neither reference counts
+    // nor elements. Writes cost Groups more copies and a vector keeps Groups replicas besides its storage.
+    template <std::size_t Groups = 2>
+    struct replicated_reads
+    {
+        static_assert(Groups > 0, "replicated_reads needs at least one group");
+    };
+
+    // Allocator of replicas of read group `group` in replicated_reads mode, by default the allocator of the vector.
+    // Specialize it for a NUMA-aware allocator to put replicas of each group on the group's node.
+    template <typename TAlloc>
+    struct read_group_allocator
+    {
+        static TAlloc get(const TAlloc& alloc, unsigned)
+        {
+            return alloc;
+        }
+    };
+
+    namespace detail
+    {
+        inline unsigned& thread_read_group()
+        {
+            static std::atomic<unsigned> next{ 0 };
+            thread_local unsigned group = next.fetch_add(1, std::memory_order_relaxed);
+            return group;
+        }
+    }
+
+    // Read group of the calling thread for replicated_reads, threads get groups round-robin by default
+    inline unsigned read_group()
+    {
+        return detail::thread_read_group();
+    }
+
+    // Assigns the calling thread to a read group, usually the NUMA node the thread is bound to
+    inline void set_read_group(unsigned group)
+    {
+        detail::thread_read_group() = group;
+    }
+
+    // Growth policy: a copy gets capacity for size * Num / Den elements, so appends after a copy are amortized O(1).
+    template <std::size_t Num = 3, std::size_t Den = 2, std::size_t Min = 4>
+    struct geometric_growth
+    {
+        static_assert(Den > 0 && Num >= Den, "geometric_growth can't give less capacity than required");
+
+        static std::size_t capacity(std::size_t required)
+        {
+            return std::max(required + required * (Num - Den) / Den, Min);
+        }
+    };
 
+    // Growth policy: a copy gets Slack additional elements.
+    template <std::size_t Slack = 4>
+    struct fixed_growth
+    {
+        static std::size_t capacity(std::size_t required)
+        {
+            return required + Slack;
+        }
+    };
+
+    // Growth policy: a copy gets exactly as many elements as it holds.
+    struct exact_growth
+    {
+        static std::size_t capacity(std::size_t required)
+        {
+            return required;
+        }
+    };
+
+    // Reclaim policy: storages replaced by a write are released right after the lock is released (default).
+    struct release_after_unlock
+    {
+        template <typename TStoragePtr>
+        static void reclaim(TStoragePtr&&)
+        {
+        }
+    };
+
+    /**
+     * Thread which releases retired storages, so element destructors don't run on writer threads.
+     * It's created on first use and stops at exit, releasing what is left. Storages retired after that
+     * (e.g. by static vectors destroyed later) are released on the calling thread.
+     */
+    class reclaim_thread
+    {
     public:
-        vector()
+        reclaim_thread()
+            : _thread(&reclaim_thread::run, this)
         {
         }
 
-        vector(const TLock& lock)
-            : _lock(lock)
+        reclaim_thread(const reclaim_thread&) = delete;
+        reclaim_thread& operator=(const reclaim_thread&) = delete;
+
+        ~reclaim_thread()
         {
+            stopped().store(true, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> locker(_lock);
+                _stopped = true;
+            }
+
+            _wakeup.notify_one();
+            _thread.join();
         }
 
-        vector(const TVector& array)
-            : _storage(array.copy())
+        void push(std::shared_ptr<void>&& storage)
+        {
+            {
+                std::lock_guard<std::mutex> locker(_lock);
+                if (!_stopped)
+                {
+                    _queue.push_back(std::move(storage));
+                    if (_queue.size() > 1) // the thread is already notified
+                        return;
+                }
+            }
+
+            _wakeup.notify_one();
+        }
+
+        // Releases storage on the thread, or right here once the thread has stopped at exit
+        static void release(std::shared_ptr<void>&& storage)
+        {
+            if (stopped().load(std::memory_order_acquire))
+                storage.reset();
+            else
+                instance().push(std::move(storage));
+        }
+
+        static reclaim_thread& instance()
+        {
+            static reclaim_thread thread;
+            return thread;
+        }
+
+    private:
+        // Trivially destructible, so it's still valid when the thread is destroyed
+        static std::atomic<bool>& stopped()
+        {
+            static std::atomic<bool> flag{ false };
+            return flag;
+        }
+
+        void run()
+        {
+            std::vector<std::shared_ptr<void>> retired;
+
+            std::unique_lock<std::mutex> locker(_lock);
+            for (;;)
+            {
+                _wakeup.wait(locker, [this] { return _stopped || !_queue.empty(); });
+                if (_queue.empty()) // stopped
+                    return;
+
+                retired.swap(_queue);
+
+                locker.unlock();
+                retired.clear(); // destructors run here without the lock
+                locker.lock();
+            }
+        }
+
+        std::mutex _lock;
+        std::condition_variable _wakeup;
+        std::vector<std::shared_ptr<void>> _queue;
+        bool _stopped = false;
+        std::thread _thread;
+    };
+
+    namespace detail
+    {
+        template <typename TBlock>
+        class storage_ref;
+    }
+
+    // Reclaim policy: storages replaced by a write are released by reclaim_thread, writers never run element destructors.
+    struct background_reclaim
+    {
+        template <typename TBlock>
+        static void reclaim(detail::storage_ref<TBlock>&& storage)
+        {
+            if (storage.unique()) // otherwise a read-only copy releases it
+                reclaim_thread::release(storage.release());
+        }
+
+        // Storage published for lock-free readers has no holders, readers may still be picking it up
+        template <typename TBlock>
+        static void reclaim(std::shared_ptr<TBlock>&& published)
+        {
+            if (published)
+                reclaim_thread::release(std::move(published));
+        }
+    };
+
+    namespace detail
+    {
+        // Iterator over range which moves elements out of rvalue ranges
+        template <typename _Range, typename _It = decltype(std::begin(std::declval<_Range&>()))>
+        using forwarding_iterator = typename std::conditional<std::is_lvalue_reference<_Range>::value, _It, std::move_iterator<_It>>::type;
+
+        template <typename TStoragePtr, typename TReadMode>
+        class publisher;
+
+        template <typename TStoragePtr>
+        class publisher<TStoragePtr, locked_reads>
+        {
+        public:
+            static const bool lock_free_reads = false;
+
+            TStoragePtr load() const { return TStoragePtr(); }
+            void store(const TStoragePtr&) {}
+            TStoragePtr exchange(const TStoragePtr&) { return TStoragePtr(); }
+
+            // Replicas are made only by replicated_reads
+            template <typename _Copy> void store(const TStoragePtr& storage, const _Copy&) { store(storage); }
+            template <typename _Copy> TStoragePtr exchange(const TStoragePtr& storage, const _Copy&) { return exchange(storage); }
+        };
+
+        template <typename TStoragePtr>
+        class publisher<TStoragePtr, atomic_reads>
+        {
+        public:
+            static const bool lock_free_reads = true;
+
+#if defined(__cpp_lib_atomic_shared_ptr)
+            TStoragePtr load() const { return _storage.load(std::memory_order_acquire); }
+            void store(const TStoragePtr& storage) { _storage.store(storage, std::memory_order_release); }
+            TStoragePtr exchange(const TStoragePtr& storage) { return _storage.exchange(storage, std::memory_order_acq_rel); }
+
+        private:
+            std::atomic<TStoragePtr> _storage;
+#else
+            TStoragePtr load() const { return std::atomic_load_explicit(&_storage, std::memory_order_acquire); }
+            void store(const TStoragePtr& storage) { std::atomic_store_explicit(&_storage, storage, std::memory_order_release); }
+            TStoragePtr exchange(const TStoragePtr& storage) { return std::atomic_exchange_explicit(&_storage, storage, std::memory_order_acq_rel); }
+
+        private:
+            TStoragePtr _storage;
+#endif
+
+        public:
+            template <typename _Copy> void store(const TStoragePtr& storage, const _Copy&) { store(storage); }
+            template <typename _Copy> TStoragePtr exchange(const TStoragePtr& storage, const _Copy&) { return exchange(storage); }
+        };
+
+        template <typename TStoragePtr, std::size_t Groups>
+        class publisher<TStoragePtr, replicated_reads<Groups>>
+        {
+        public:
+            static const bool lock_free_reads = true;
+
+            // Returns the replica of the calling thread's group
+            TStoragePtr load() const
+            {
+                replica& group = _replicas[read_group() % Groups];
+                std::lock_guard<spin_lock> locker(group.lock);
+                return group.storage;
+            }
+
+            // Publishes storage to every group, copy(storage, group) makes a replica with the allocator of the group
+            template <typename _Copy>
+            void store(const TStoragePtr& storage, const _Copy& copy)
+            {
+                exchange(storage, copy);
+            }
+
+            // Returns the previous replicas kept alive by one pointer, so the caller releases them after unlocking
+            template <typename _Copy>
+            TStoragePtr exchange(const TStoragePtr& storage, const _Copy& copy)
+            {
+                auto replicas = std::make_shared<std::array<TStoragePtr, Groups>>();
+                for (std::size_t i = 0; i < Groups; ++i) // copies are made before any group can see them
+                {
+                    TStoragePtr& replica = (*replicas)[i];
+                    replica = storage;
+                    if (storage)
+                    {
+                        try
+                        {
+                            replica = copy(*storage, unsigned(i));
+                        }
+                        catch (...) // the group reads the storage itself
+                        {
+                        }
+                    }
+                }
+
+                // all groups switch at once, so a reader never sees an older state than a reader before it
+                for (auto& group : _replicas)
+                    group.lock.lock();
+                for (std::size_t i = 0; i < Groups; ++i)
+                    std::swap(_replicas[i].storage, (*replicas)[i]);
+                for (auto& group : _replicas)
+                    group.lock.unlock();
+
+                return TStoragePtr(replicas, (*replicas)[0].get());
+            }
+
+        private:
+            struct alignas(cache_line_size) replica
+            {
+                spin_lock lock;
+                TStoragePtr storage;
+            };
+
+            mutable replica _replicas[Groups];
+        };
+
+        template <typename TReadMode>
+        struct is_replicated : std::false_type {};
+
+        template <std::size_t Groups>
+        struct is_replicated<replicated_reads<Groups>> : std::true_type {};
+    }
+
+    namespace detail
+    {
+        // Memory block shared by allocations of one storage, it's freed when all of them are released
+        class arena
+        {
+        public:
+            explicit arena(std::size_t units)
+                : _units(units)
+            {
+                _cursor = reinterpret_cast<char*>(this) + header_size();
+                _end = units == 0 ? _cursor : reinterpret_cast<char*>(this) + units * sizeof(std::max_align_t);
+            }
+
+            static std::size_t header_size()
+            {
+                return (sizeof(arena) + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t) * sizeof(std::max_align_t);
+            }
+
+            void* take(std::size_t size, std::size_t alignment)
+            {
+                void* p = _cursor;
+                std::size_t space = std::size_t(_end - _cursor);
+                if (!std::align(alignment, size, p, space))
+                {
+                    if (_requested == 0) // remember the first request which didn't fit
+                        _requested = size + alignment;
+                    return nullptr;
+                }
+
+                _cursor = static_cast<char*>(p) + size;
+                ++_live;
+                return p;
+            }
+
+            bool owns(const void* p) const
+            {
+                return p >= static_cast<const void*>(this) && p < static_cast<const void*>(_end);
+            }
+
+            // Returns true when the last allocation is released and the block can be freed
+            bool release()
+            {
+                return --_live == 0;
+            }
+
+            std::size_t units() const { return _units; }
+            std::size_t requested() const { return _requested; }
+
+        private:
+            std::size_t _units;
+            std::size_t _live = 0;
+            std::size_t _requested = 0;
+            char* _cursor;
+            char* _end;
+        };
+    }
+
+    /**
+     * Allocator for single allocation storages: a vector storage created with it places control block,
+     * vector header and element buffer in one memory block, so a copy costs one allocation instead of three.
+     * Buffers allocated later, when the storage grows in place, come from TBase.
+     */
+    template <typename T, typename TBase = std::allocator<T>>
+    class inline_allocator
+    {
+    private:
+        typedef std::allocator_traits<TBase> TBaseTraits;
+        typedef typename TBaseTraits::template rebind_alloc<std::max_align_t> TBlockAlloc;
+        typedef std::allocator_traits<TBlockAlloc> TBlockTraits;
+
+        template <typename U, typename UBase> friend class inline_allocator;
+
+    public:
+        typedef T value_type;
+
+        template <typename U>
+        struct rebind
+        {
+            typedef inline_allocator<U, typename TBaseTraits::template rebind_alloc<U>> other;
+        };
+
+        inline_allocator() = default;
+
+        inline_allocator(const TBase& base, detail::arena* arena = nullptr)
+            : _base(base)
+            , _arena(arena)
+        {
+        }
+
+        template <typename U, typename UBase>
+        inline_allocator(const inline_allocator<U, UBase>& other)
+            : _base(other._base)
+            , _arena(other._arena)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            if (_arena)
+                if (void* p = _arena->take(n * sizeof(T), alignof(T)))
+                    return static_cast<T*>(p);
+
+            return TBaseTraits::allocate(_base, n);
+        }
+
+        void deallocate(T* p, std::size_t n)
+        {
+            if (!_arena || !_arena->owns(p))
+                TBaseTraits::deallocate(_base, p, n);
+            else if (_arena->release()) // it was the last allocation in the block
+            {
+                TBlockAlloc block(_base);
+                TBlockTraits::deallocate(block, reinterpret_cast<std::max_align_t*>(_arena), _arena->units());
+            }
+        }
+
+        // Copies of a container don't share its block
+        inline_allocator select_on_container_copy_construction() const
+        {
+            return inline_allocator(TBaseTraits::select_on_container_copy_construction(_base));
+        }
+
+        // Creates storage with capacity for elements in one allocation
+        template <typename TStorage>
+        std::shared_ptr<TStorage> make_storage(std::size_t capacity) const
+        {
+            if (capacity == 0)
+                return std::allocate_shared<TStorage>(*this, *this);
+
+            static const std::size_t control_block = control_block_size<TStorage>();
+
+            std::size_t size = detail::arena::header_size() + control_block + capacity * sizeof(T) + alignof(T);
+            std::size_t units = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+
+            TBlockAlloc block(_base);
+            detail::arena* arena = new (TBlockTraits::allocate(block, units)) detail::arena(units);
+
+            // the control block is the first allocation and the last release, so it keeps the block alive
+            inline_allocator alloc(_base, arena);
+            std::shared_ptr<TStorage> storage = std::allocate_shared<TStorage>(alloc, alloc);
+            storage->reserve(capacity);
+            return storage;
+        }
+
+        friend bool operator==(const inline_allocator& left, const inline_allocator& right)
+        {
+            return left._arena == right._arena && left._base == right._base;
+        }
+
+        friend bool operator!=(const inline_allocator& left, const inline_allocator& right)
+        {
+            return !(left == right);
+        }
+
+    private:
+        // Size of shared_ptr control block is implementation defined, so it's measured once per storage type
+        template <typename TStorage>
+        std::size_t control_block_size() const
+        {
+            detail::arena probe(0);
+            inline_allocator alloc(_base, &probe);
+            std::allocate_shared<TStorage>(alloc, alloc);
+            return probe.requested();
+        }
+
+        TBase _base;
+        detail::arena* _arena = nullptr;
+    };
+
+    /**
+     * Thread safe free lists of memory blocks keyed by size class (power of two).
+     * Retired storages put their buffers here and copies take them back, so steady-state churn
+     * doesn't touch malloc. Each size class keeps at most max_blocks free blocks.
+     */
+    class recycling_pool
+    {
+    public:
+        explicit recycling_pool(std::size_t max_blocks = 16)
+            : _max_blocks(max_blocks)
+        {
+        }
+
+        recycling_pool(const recycling_pool&) = delete;
+        recycling_pool& operator=(const recycling_pool&) = delete;
+
+        ~recycling_pool()
+        {
+            for (std::size_t i = 0; i < Classes; ++i)
+                for (void* p : _free[i])
+                    ::operator delete(p);
+        }
+
+        void* allocate(std::size_t bytes)
+        {
+            std::size_t index = size_class(bytes);
+            if (index == Classes) // too large for recycling
+                return ::operator new(bytes);
+
+            {
+                std::lock_guard<std::mutex> locker(_lock);
+                if (!_free[index].empty())
+                {
+                    void* p = _free[index].back();
+                    _free[index].pop_back();
+                    return p;
+                }
+            }
+
+            return ::operator new(std::size_t(MinSize) << index);
+        }
+
+        void deallocate(void* p, std::size_t bytes)
+        {
+            std::size_t index = size_class(bytes);
+            if (index != Classes)
+            {
+                std::lock_guard<std::mutex> locker(_lock);
+                if (_free[index].size() < _max_blocks)
+                {
+                    if (_free[index].capacity() == 0)
+                        _free[index].reserve(_max_blocks); // never reallocate under the lock after that
+                    _free[index].push_back(p);
+                    return;
+                }
+            }
+
+            ::operator delete(p);
+        }
+
+        // Number of free blocks kept by the pool
+        std::size_t cached() const
+        {
+            std::lock_guard<std::mutex> locker(_lock);
+
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < Classes; ++i)
+                count += _free[i].size();
+
+            return count;
+        }
+
+        // Pool shared by default constructed pool_allocator
+        static const std::shared_ptr<recycling_pool>& instance()
+        {
+            static const std::shared_ptr<recycling_pool> pool = std::make_shared<recycling_pool>();
+            return pool;
+        }
+
+    private:
+        static const std::size_t MinSize = 64;
+        static const std::size_t Classes = 26; // up to 2 GB
+
+        static std::size_t size_class(std::size_t bytes)
+        {
+            std::size_t index = 0;
+            while (index < Classes && (std::size_t(MinSize) << index) < bytes)
+                ++index;
+
+            return index;
+        }
+
+        mutable std::mutex _lock;
+        std::vector<void*> _free[Classes];
+        std::size_t _max_blocks;
+    };
+
+    /**
+     * Allocator which takes memory from recycling_pool. Use it as TAlloc of vector (alone or as TBase of
+     * inline_allocator) with a pool per vector or the shared default pool.
+     */
+    template <typename T>
+    class pool_allocator
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "pool_allocator doesn't support over-aligned types");
+
+        template <typename U> friend class pool_allocator;
+
+    public:
+        typedef T value_type;
+
+        pool_allocator()
+            : _pool(recycling_pool::instance())
+        {
+        }
+
+        explicit pool_allocator(const std::shared_ptr<recycling_pool>& pool)
+            : _pool(pool)
+        {
+        }
+
+        template <typename U>
+        pool_allocator(const pool_allocator<U>& other)
+            : _pool(other._pool)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            return static_cast<T*>(_pool->allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, std::size_t n)
+        {
+            _pool->deallocate(p, n * sizeof(T));
+        }
+
+        const std::shared_ptr<recycling_pool>& pool() const
+        {
+            return _pool;
+        }
+
+        friend bool operator==(const pool_allocator& left, const pool_allocator& right)
+        {
+            return left._pool == right._pool;
+        }
+
+        friend bool operator!=(const pool_allocator& left, const pool_allocator& right)
+        {
+            return left._pool != right._pool;
+        }
+
+    private:
+        std::shared_ptr<recycling_pool> _pool;
+    };
+
+    namespace detail
+    {
+        template <typename TStorage, typename TAlloc>
+        std::shared_ptr<TStorage> make_storage(const TAlloc& alloc, std::size_t capacity)
+        {
+            std::shared_ptr<TStorage> storage = std::allocate_shared<TStorage>(alloc, alloc);
+            storage->reserve(capacity);
+            return storage;
+        }
+
+        template <typename TStorage, typename T, typename TBase>
+        std::shared_ptr<TStorage> make_storage(const inline_allocator<T, TBase>& alloc, std::size_t capacity)
+        {
+            return alloc.template make_storage<TStorage>(capacity);
+        }
+    }
+
+    namespace detail
+    {
+        // Storage with explicit count of its holders: the vector itself, read-only copies and iterators
+        template <typename TStorage>
+        class counted_storage : public TStorage
+        {
+        public:
+            template <typename... Args>
+            explicit counted_storage(Args&&... args)
+                : TStorage(std::forward<Args>(args)...)
+            {
+            }
+
+            std::atomic<std::size_t> holders{0};
+        };
+
+        /**
+         * Handle to counted_storage which registers itself as a holder. A holder leaves with release semantics
+         * and unique() checks the count with acquire, so a writer which is the only holder can change
+         * the storage in place without a data race with former holders (unlike shared_ptr::use_count()).
+         */
+        template <typename TBlock>
+        class storage_ref
+        {
+        public:
+            typedef std::shared_ptr<TBlock> TSharedPtr;
+
+            storage_ref() = default;
+
+            storage_ref(TSharedPtr storage)
+                : _storage(std::move(storage))
+            {
+                enter();
+            }
+
+            storage_ref(const storage_ref& right)
+                : _storage(right._storage)
+            {
+                enter();
+            }
+
+            storage_ref(storage_ref&& right) noexcept
+                : _storage(std::move(right._storage))
+            {
+            }
+
+            ~storage_ref()
+            {
+                leave();
+            }
+
+            storage_ref& operator=(storage_ref right) noexcept
+            {
+                _storage.swap(right._storage);
+                return *this;
+            }
+
+            void reset()
+            {
+                leave();
+                _storage.reset();
+            }
+
+            // Stops being a holder and gives away the storage
+            TSharedPtr release()
+            {
+                leave();
+                return std::move(_storage);
+            }
+
+            // Returns true if nobody else holds the storage
+            bool unique() const
+            {
+                return _storage && _storage->holders.load(std::memory_order_acquire) == 1;
+            }
+
+            const TSharedPtr& shared() const { return _storage; }
+
+            TBlock* get() const { return _storage.get(); }
+            TBlock* operator->() const { return _storage.get(); }
+            TBlock& operator*() const { return *_storage; }
+
+            explicit operator bool() const { return static_cast<bool>(_storage); }
+
+            bool operator==(storage_ref const& right) const { return _storage == right._storage; }
+            bool operator!=(storage_ref const& right) const { return _storage != right._storage; }
+
+        private:
+            void enter()
+            {
+                if (_storage)
+                    _storage->holders.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void leave()
+            {
+                if (_storage)
+                    _storage->holders.fetch_sub(1, std::memory_order_release);
+            }
+
+            TSharedPtr _storage;
+        };
+    }
+
+    namespace detail
+    {
+        // Base of nodes shared between storages (tries, hash tables), node_ref counts its holders in it
+        struct counted_node
+        {
+            counted_node() = default;
+            counted_node(const counted_node&) {} // a copy starts with no holders
+
+            std::atomic<std::size_t> holders{0};
+        };
+
+        /**
+         * Intrusive reference to a counted_node held by parent nodes and storages. A holder leaves with release
+         * semantics and unique() checks the count with acquire, so a writer which is the only holder can change
+         * the node in place without a data race with former holders (unlike shared_ptr::use_count()).
+         */
+        template <typename TNode>
+        class node_ref
+        {
+        public:
+            node_ref() = default;
+
+            explicit node_ref(TNode* n) noexcept
+                : _node(n)
+            {
+                if (_node)
+                    _node->holders.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            node_ref(const node_ref& right) noexcept
+                : node_ref(right._node)
+            {
+            }
+
+            node_ref(node_ref&& right) noexcept
+                : _node(right._node)
+            {
+                right._node = nullptr;
+            }
+
+            ~node_ref()
+            {
+                reset();
+            }
+
+            node_ref& operator=(node_ref right) noexcept
+            {
+                std::swap(_node, right._node);
+                return *this;
+            }
+
+            void reset() noexcept
+            {
+                if (_node && _node->holders.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete _node;
+
+                _node = nullptr;
+            }
+
+            // Returns true if nobody else holds the node
+            bool unique() const
+            {
+                return _node && _node->holders.load(std::memory_order_acquire) == 1;
+            }
+
+            TNode* get() const { return _node; }
+            TNode* operator->() const { return _node; }
+            TNode& operator*() const { return *_node; }
+
+            explicit operator bool() const { return _node != nullptr; }
+
+        private:
+            TNode* _node = nullptr;
+        };
+    }
+
+    // Tells what a write did with the storage
+    enum class write_result
+    {
+        in_place, // nobody held read-only copy, the storage was changed in place
+        copied    // somebody held read-only copy, the change was made on a copy
+    };
+
+    // Statistics policy which collects nothing, it adds neither code nor data to vector
+    struct no_stats
+    {
+        static const bool enabled = false;
+
+        // Token kept by read-only copies and iterators
+        struct snapshot
+        {
+            snapshot() = default;
+            explicit snapshot(const no_stats&) {}
+        };
+
+        void lock_acquired(std::uint64_t /*wait_ns*/) {}
+        void lock_released(std::uint64_t /*hold_ns*/) {}
+        void write(write_result /*result*/, std::size_t /*bytes_copied*/) {}
+    };
+
+    /**
+     * Statistics policy for vector: writes done in place and on a copy, bytes copied, histograms of
+     * writer lock wait and hold times and the number of live read-only copies and iterators.
+     * Counters are shared with the copies and iterators, so they may outlive the vector.
+     * Every read-only copy and iterator updates the shared counters, it costs one more atomic
+     * reference count per snapshot.
+     */
+    class vector_stats
+    {
+    public:
+        static const bool enabled = true;
+
+        // Bucket i of a histogram counts durations in [2^i, 2^(i+1)) nanoseconds
+        static const std::size_t buckets = 40;
+
+        struct counters
+        {
+            counters()
+            {
+                for (std::size_t i = 0; i < buckets; ++i)
+                {
+                    lock_wait[i] = 0;
+                    lock_hold[i] = 0;
+                }
+            }
+
+            std::atomic<std::uint64_t> in_place_writes{ 0 };
+            std::atomic<std::uint64_t> copied_writes{ 0 };
+            std::atomic<std::uint64_t> bytes_copied{ 0 };
+            std::atomic<std::uint64_t> lock_wait[buckets];
+            std::atomic<std::uint64_t> lock_hold[buckets];
+            std::atomic<std::ptrdiff_t> snapshots{ 0 }; // live read-only copies and iterators
+        };
+
+        class snapshot
+        {
+        public:
+            snapshot() = default;
+
+            explicit snapshot(const vector_stats& stats)
+                : _counters(stats._counters)
+            {
+                enter();
+            }
+
+            snapshot(const snapshot& copy)
+                : _counters(copy._counters)
+            {
+                enter();
+            }
+
+            snapshot& operator=(const snapshot& right)
+            {
+                snapshot copy(right);
+                std::swap(_counters, copy._counters);
+                return *this;
+            }
+
+            ~snapshot()
+            {
+                if (_counters)
+                    _counters->snapshots.fetch_sub(1, std::memory_order_relaxed);
+            }
+
+        private:
+            void enter()
+            {
+                if (_counters)
+                    _counters->snapshots.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            std::shared_ptr<counters> _counters;
+        };
+
+        vector_stats()
+            : _counters(std::make_shared<counters>())
+        {
+        }
+
+        // A copy of vector has its own statistics
+        vector_stats(const vector_stats&)
+            : vector_stats()
+        {
+        }
+
+        vector_stats& operator=(const vector_stats&) = delete;
+
+        const counters& get() const
+        {
+            return *_counters;
+        }
+
+        void lock_acquired(std::uint64_t wait_ns)
+        {
+            _counters->lock_wait[bucket(wait_ns)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void lock_released(std::uint64_t hold_ns)
+        {
+            _counters->lock_hold[bucket(hold_ns)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void write(write_result result, std::size_t bytes_copied)
+        {
+            if (result == write_result::in_place)
+                _counters->in_place_writes.fetch_add(1, std::memory_order_relaxed);
+            else
+            {
+                _counters->copied_writes.fetch_add(1, std::memory_order_relaxed);
+                _counters->bytes_copied.fetch_add(bytes_copied, std::memory_order_relaxed);
+            }
+        }
+
+    private:
+        static std::size_t bucket(std::uint64_t ns)
+        {
+            std::size_t i = 0;
+            while (ns > 1 && i + 1 < buckets)
+            {
+                ns >>= 1;
+                ++i;
+            }
+
+            return i;
+        }
+
+        std::shared_ptr<counters> _counters;
+    };
+
+    namespace detail
+    {
+        // Measures how long the writer waited for the lock and held it, it's empty if TStats collects nothing
+        template <typename TStats, bool = TStats::enabled>
+        class lock_timer
+        {
+        public:
+            explicit lock_timer(TStats&) {}
+
+            void acquired() {}
+        };
+
+        template <typename TStats>
+        class lock_timer<TStats, true>
+        {
+            typedef std::chrono::steady_clock clock;
+
+        public:
+            explicit lock_timer(TStats& stats)
+                : _stats(stats)
+                , _start(clock::now())
+            {
+            }
+
+            void acquired()
+            {
+                clock::time_point now = clock::now();
+                _stats.lock_acquired(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - _start).count()));
+                _start = now;
+            }
+
+            // it's destroyed right after unlocking
+            ~lock_timer()
+            {
+                _stats.lock_released(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _start).count()));
+            }
+
+        private:
+            TStats& _stats;
+            clock::time_point _start;
+        };
+    }
+
+    namespace detail
+    {
+        // Sleeping waiters of vectors, they are spread over buckets by address of the vector
+        struct wait_bucket
+        {
+            std::mutex lock;
+            std::condition_variable changed;
+        };
+
+        inline wait_bucket& wait_bucket_for(const void* address)
+        {
+            static wait_bucket buckets[64];
+            return buckets[(reinterpret_cast<std::uintptr_t>(address) / 64) % 64];
+        }
+
+        /**
+         * Waiters and subscribers of a vector, writers notify them after unlocking. Waiters are counted
+         * under the vector lock, so a write checks them with two plain loads and nothing more while nobody
+         * waits or subscribes. Copies of a vector have their own subscribers.
+         */
+        class change_notifier
+        {
+        public:
+            typedef std::function<void(std::size_t)> callback;
+
+            // Subscribed callback, its calls are serialized and it isn't called after unsubscribe() returns
+            struct subscriber
+            {
+                explicit subscriber(callback&& f)
+                    : func(std::move(f))
+                {
+                }
+
+                std::recursive_mutex lock; // it's recursive, so the callback can unsubscribe itself
+                callback func;
+                bool active = true;
+            };
+
+            typedef std::vector<std::shared_ptr<subscriber>> TSubscribers;
+
+            change_notifier() = default;
+
+            change_notifier(const change_notifier&)
+            {
+            }
+
+            change_notifier& operator=(const change_notifier&)
+            {
+                return *this;
+            }
+
+            // This method should be called only under lock.
+            // Tells a write whether it has to notify anybody.
+            bool wanted() const
+            {
+                return _waiters.load(std::memory_order_relaxed) || _count.load(std::memory_order_relaxed);
+            }
+
+            // This method should be called only under lock.
+            // Counts a waiter which has seen the current version, the next write will wake it.
+            void waiting() const
+            {
+                _waiters.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Wakes waiters and calls subscribers after a write published version
+            void notify(std::size_t version) const
+            {
+                if (_waiters.load(std::memory_order_relaxed))
+                {
+                    wait_bucket& bucket = wait_bucket_for(this);
+                    {
+                        std::lock_guard<std::mutex> locker(bucket.lock); // a waiter either sees the version or already sleeps
+                    }
+                    bucket.changed.notify_all();
+                }
+
+                if (_count.load(std::memory_order_relaxed) == 0)
+                    return;
+
+                std::shared_ptr<const TSubscribers> subscribers;
+                {
+                    std::lock_guard<std::mutex> locker(_lock);
+                    subscribers = _subscribers;
+                }
+
+                for (const std::shared_ptr<subscriber>& s : *subscribers)
+                {
+                    std::lock_guard<std::recursive_mutex> locker(s->lock);
+                    if (s->active)
+                        s->func(version);
+                }
+            }
+
+            // Sleeps after waiting() until version differs from known or deadline passes, returns the last seen version
+            template <typename _Deadline>
+            std::size_t wait(const std::atomic<std::size_t>& version, std::size_t known, _Deadline deadline) const
+            {
+                wait_bucket& bucket = wait_bucket_for(this);
+
+                std::size_t current;
+                {
+                    std::unique_lock<std::mutex> locker(bucket.lock);
+                    while ((current = version.load(std::memory_order_acquire)) == known && deadline(bucket.changed, locker))
+                    {
+                    }
+                }
+
+                _waiters.fetch_sub(1, std::memory_order_relaxed);
+                return current;
+            }
+
+            std::shared_ptr<subscriber> subscribe(callback&& func)
+            {
+                std::shared_ptr<subscriber> s = std::make_shared<subscriber>(std::move(func));
+
+                std::lock_guard<std::mutex> locker(_lock);
+                std::shared_ptr<TSubscribers> subscribers = _subscribers ? std::make_shared<TSubscribers>(*_subscribers) : std::make_shared<TSubscribers>();
+                subscribers->push_back(s);
+                _subscribers = std::move(subscribers);
+                _count.fetch_add(1, std::memory_order_relaxed);
+                return s;
+            }
+
+            void unsubscribe(const std::shared_ptr<subscriber>& s)
+            {
+                {
+                    std::lock_guard<std::mutex> locker(_lock);
+                    std::shared_ptr<TSubscribers> subscribers = std::make_shared<TSubscribers>(*_subscribers);
+                    subscribers->erase(std::remove(subscribers->begin(), subscribers->end(), s), subscribers->end());
+                    _subscribers = std::move(subscribers);
+                    _count.fetch_sub(1, std::memory_order_relaxed);
+                }
+
+                std::lock_guard<std::recursive_mutex> locker(s->lock); // waits for a running call
+                s->active = false;
+            }
+
+        private:
+            mutable std::mutex _lock;
+            std::shared_ptr<const TSubscribers> _subscribers; // it's created by the first subscribe()
+            std::atomic<std::size_t> _count{ 0 }; // number of subscribers
+            mutable std::atomic<std::size_t> _waiters{ 0 };
+        };
+
+        // Notifies change_notifier when a write lock is destroyed, after unlocking
+        class change_notice
+        {
+        public:
+            explicit change_notice(const change_notifier& notifier)
+                : _notifier(notifier)
+            {
+            }
+
+            void published(std::size_t version)
+            {
+                _version = version;
+                _published = true;
+            }
+
+            ~change_notice()
+            {
+                if (_published)
+                    _notifier.notify(_version);
+            }
+
+        private:
+            const change_notifier& _notifier;
+            std::size_t _version = 0;
+            bool _published = false;
+        };
+    }
+
+    /**
+     * Subscription of a callback to writes of a vector, it's cancelled on destruction or reset().
+     * The vector must outlive it.
+     */
+    class subscription
+    {
+    public:
+        subscription() = default;
+
+        subscription(detail::change_notifier* notifier, std::shared_ptr<detail::change_notifier::subscriber> subscriber)
+            : _notifier(notifier)
+            , _subscriber(std::move(subscriber))
+        {
+        }
+
+        subscription(subscription&& right) noexcept
+            : _notifier(right._notifier)
+            , _subscriber(std::move(right._subscriber))
+        {
+        }
+
+        subscription& operator=(subscription&& right) noexcept
+        {
+            if (this != &right)
+            {
+                reset();
+                _notifier = right._notifier;
+                _subscriber = std::move(right._subscriber);
+            }
+
+            return *this;
+        }
+
+        ~subscription()
+        {
+            reset();
+        }
+
+        // Unsubscribes, once it returns the callback isn't running and won't be called
+        void reset()
+        {
+            if (_subscriber)
+                _notifier->unsubscribe(_subscriber);
+            _subscriber.reset();
+        }
+
+    private:
+        detail::change_notifier* _notifier = nullptr;
+        std::shared_ptr<detail::change_notifier::subscriber> _subscriber;
+    };
+
+    // Predicate elem == value, search with it is vectorized for arithmetic T
+    template <typename T>
+    struct equals_predicate
+    {
+        T value;
+
+        bool operator()(const T& elem) const { return elem == value; }
+    };
+
+    // Predicate low <= elem < high, search with it is vectorized for arithmetic T
+    template <typename T>
+    struct in_range_predicate
+    {
+        T low;
+        T high;
+
+        bool operator()(const T& elem) const { return !(elem < low) && elem < high; }
+    };
+
+    template <typename T>
+    equals_predicate<T> equals(T value)
+    {
+        return equals_predicate<T>{ value };
+    }
+
+    template <typename T>
+    in_range_predicate<T> in_range(T low, T high)
+    {
+        return in_range_predicate<T>{ low, high };
+    }
+
+    namespace detail
+    {
+        template <typename T, typename _Pred>
+        struct is_vectorizable : std::false_type {};
+
+        template <typename T>
+        struct is_vectorizable<T, equals_predicate<T>> : std::is_arithmetic<T> {};
+
+        template <typename T>
+        struct is_vectorizable<T, in_range_predicate<T>> : std::is_arithmetic<T> {};
+
+        // Elements checked at once by vectorized scans
+        static const std::size_t scan_block = 64;
+
+        // Branch-free check of one element, compilers turn loops of it into SIMD compares
+        template <typename T>
+        unsigned match(const T& elem, const equals_predicate<T>& predicate)
+        {
+            return unsigned(elem == predicate.value);
+        }
+
+        template <typename T>
+        unsigned match(const T& elem, const in_range_predicate<T>& predicate)
+        {
+            return unsigned(!(elem < predicate.low)) & unsigned(elem < predicate.high);
+        }
+
+        template <typename T, typename _Pred>
+        unsigned match_block(const T* data, const _Pred& predicate)
+        {
+            unsigned hits = 0;
+            for (std::size_t i = 0; i < scan_block; ++i)
+                hits |= match(data[i], predicate);
+
+            return hits;
+        }
+
+        // Index of the first element of data[0, size) matching predicate, size if there is no such element
+        template <typename T, typename _Pred>
+        std::size_t find_first(const T* data, std::size_t size, _Pred predicate, std::false_type)
+        {
+            return std::size_t(std::find_if(data, data + size, predicate) - data);
+        }
+
+        template <typename T, typename _Pred>
+        std::size_t find_first(const T* data, std::size_t size, _Pred predicate, std::true_type)
+        {
+            std::size_t i = 0;
+            while (i + scan_block <= size && !match_block(data + i, predicate))
+                i += scan_block;
+
+            return i + find_first(data + i, size - i, predicate, std::false_type());
+        }
+
+        // Index of the last element of data[0, size) matching predicate, size if there is no such element
+        template <typename T, typename _Pred>
+        std::size_t find_last(const T* data, std::size_t size, _Pred predicate, std::false_type)
+        {
+            for (std::size_t i = size; i > 0; --i)
+                if (predicate(data[i - 1]))
+                    return i - 1;
+
+            return size;
+        }
+
+        template <typename T, typename _Pred>
+        std::size_t find_last(const T* data, std::size_t size, _Pred predicate, std::true_type)
+        {
+            std::size_t end = size;
+            while (end >= scan_block && !match_block(data + end - scan_block, predicate))
+                end -= scan_block;
+
+            std::size_t pos = find_last(data, end, predicate, std::false_type());
+            return pos == end ? size : pos;
+        }
+
+        template <typename T, typename _Pred>
+        std::size_t count_if(const T* data, std::size_t size, _Pred predicate, std::false_type)
+        {
+            return std::size_t(std::count_if(data, data + size, predicate));
+        }
+
+        template <typename T, typename _Pred>
+        std::size_t count_if(const T* data, std::size_t size, _Pred predicate, std::true_type)
+        {
+            std::size_t count = 0, i = 0;
+            for (; i + scan_block <= size; i += scan_block)
+            {
+                unsigned hits = 0;
+                for (std::size_t j = 0; j < scan_block; ++j)
+                    hits += match(data[i + j], predicate);
+                count += hits;
+            }
+
+            return count + count_if(data + i, size - i, predicate, std::false_type());
+        }
+
+        // Indexes of all elements of data[0, size) matching predicate
+        template <typename T, typename _Pred, typename _Vectorized>
+        std::vector<std::size_t> find_all(const T* data, std::size_t size, _Pred predicate, _Vectorized vectorized)
+        {
+            std::vector<std::size_t> indexes;
+            for (std::size_t i = find_first(data, size, predicate, vectorized); i < size; i = i + 1 + find_first(data + i + 1, size - i - 1, predicate, vectorized))
+                indexes.push_back(i);
+
+            return indexes;
+        }
+    }
+
+    /**
+     * This is copy on write vector implmentation with short synchronizations.
+     * Read operations take a copy with short blocking just to get a copy (shared if TLock supports it, see read_locker).
+     * Write operations are synchronized and it makes a copy of data if somebody keeps readonly copy.
+     * With TReadMode = atomic_reads readers don't take the lock at all, see atomic_reads.
+     * TGrowth decides capacity of copies, see geometric_growth.
+     * Storages replaced by writes are released outside the lock, TReclaim decides where, see background_reclaim.
+     * TStats collects statistics of writes, lock times and snapshots, see vector_stats.
+     *
+     * @author Alexander Kozlov
+     */
+    template <typename T, typename TLock = std::mutex, typename TLocker = std::lock_guard<TLock>, typename TAlloc = std::allocator<T>, typename TReadMode = locked_reads, typename TGrowth = geometric_growth<>, typename TReclaim = release_after_unlock, typename TStats = no_stats>
+    class vector : private TStats // a base, so no_stats takes no space
+    {
+    private:
+        typedef vector<T, TLock, TLocker, TAlloc, TReadMode, TGrowth, TReclaim, TStats> TVector;
+        typedef std::vector<T, TAlloc> TStorage;
+        typedef detail::counted_storage<TStorage> TBlock;
+        typedef std::shared_ptr<TBlock> TSharedPtr;
+        typedef detail::storage_ref<TBlock> TStoragePtr;
+        typedef detail::publisher<TSharedPtr, TReadMode> TPublisher;
+        typedef typename read_locker<TLock, TLocker>::type TReadLocker;
+
+        template <typename _Pred>
+        using TVectorized = detail::is_vectorizable<T, typename std::decay<_Pred>::type>;
+
+        // Copies of trivially copyable elements are made at once (memcpy) and edited in place,
+        // removal does so only for small ones where compacting the copy is cheaper than copying runs
+        typedef std::integral_constant<bool, std::is_trivially_copyable<T>::value> TTrivial;
+        typedef std::integral_constant<bool, TTrivial::value && sizeof(T) <= 2 * sizeof(void*)> TTrivialSmall;
+
+#if defined(__cpp_lib_execution)
+        template <typename _ExecPolicy>
+        using TIfPolicy = typename std::enable_if<std::is_execution_policy<typename std::decay<_ExecPolicy>::type>::value>::type;
+#endif
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+        typedef TAlloc allocator_type;
+
+    private:
+        // Lock for writes, storages replaced under it are reclaimed after unlocking
+        class write_lock
+        {
+        public:
+            write_lock(TLock& lock, TStats& stats, const detail::change_notifier& notifier)
+                : _notice(notifier)
+                , _timer(stats)
+                , _locker(lock)
+            {
+                _timer.acquired();
+            }
+
+            void retire(TStoragePtr&& storage)
+            {
+                _retired.storage = std::move(storage);
+            }
+
+            void retire(TSharedPtr&& published)
+            {
+                _retired.published = std::move(published);
+            }
+
+            // Marks the write as made on a copy
+            void copying()
+            {
+                _copied = true;
+            }
+
+            bool copied() const
+            {
+                return _copied;
+            }
+
+            // Counts elements copied from the current storage for statistics
+            void add_copied(std::size_t count)
+            {
+                _copied_count += count;
+            }
+
+            std::size_t copied_count() const
+            {
+                return _copied_count;
+            }
+
+            // Waiters and subscribers get version after unlocking
+            void published(std::size_t version)
+            {
+                _notice.published(version);
+            }
+
+        private:
+            struct retired_storages
+            {
+                ~retired_storages()
+                {
+                    TReclaim::reclaim(std::move(storage));
+                    TReclaim::reclaim(std::move(published));
+                }
+
+                TStoragePtr storage;
+                TSharedPtr published;
+            };
+
+            detail::change_notice _notice; // it's destroyed last, so notifications come after reclaiming
+            retired_storages _retired; // it's destroyed after _locker
+            detail::lock_timer<TStats> _timer;
+            TLocker _locker;
+            bool _copied = false;
+            std::size_t _copied_count = 0;
+        };
+
+    public:
+        vector()
+        {
+        }
+
+        vector(const TLock& lock)
+            : _lock(lock)
+        {
+        }
+
+        explicit vector(const TAlloc& alloc)
+            : _alloc(alloc)
+        {
+        }
+
+        vector(const TLock& lock, const TAlloc& alloc)
+            : _lock(lock)
+            , _alloc(alloc)
+        {
+        }
+
+        vector(const TVector& array)
+            : _storage(array.copy())
+            , _alloc(std::allocator_traits<TAlloc>::select_on_container_copy_construction(array._alloc))
+        {
+            _published.store(_storage.shared(), replicator{ _alloc });
+        }
+
+        void clear()
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+            replace(locker, TStoragePtr());
+            publish(locker);
+        }
+
+        TVector& operator=(const TVector& _Right)
+        {
+            TStoragePtr storage_copy = _Right.copy();
+
+            {
+                write_lock locker(_lock, writable_stats(), _notifier);
+                replace(locker, storage_copy);
+                publish(locker);
+            }
+
+            return *this;
+        }
+
+        write_result push_front(const T& t)
+        {
+            return emplace_front(t);
+        }
+
+        write_result push_front(T&& t)
+        {
+            return emplace_front(std::move(t));
+        }
+
+        write_result push_back(const T& t)
+        {
+            return emplace_back(t);
+        }
+
+        write_result push_back(T&& t)
+        {
+            return emplace_back(std::move(t));
+        }
+
+        template< class... Args>
+        write_result emplace_front(Args&&... args)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            write_result result = write_result::copied;
+            if (unique()) // nobody holds read-only copy of vector
+            {
+                _storage->emplace(_storage->begin(), std::forward<Args>(args)...);
+                result = write_result::in_place;
+            }
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, size_unlocked() + 1);
+                newStorage->emplace_back(std::forward<Args>(args)...);
+                if (_storage) // copy everything
+                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
+                locker.add_copied(size_unlocked());
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return result;
+        }
+
+        template< class... Args>
+        write_result emplace_back(Args&&... args)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            write_result result = write_result::copied;
+            if (unique()) // nobody holds read-only copy of vector
+            {
+                _storage->emplace_back(std::forward<Args>(args)...);
+                result = write_result::in_place;
+            }
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, size_unlocked() + 1);
+                if (_storage) // copy everything
+                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
+                newStorage->emplace_back(std::forward<Args>(args)...);
+                locker.add_copied(size_unlocked());
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return result;
+        }
+
+        // Inserts [first, last) before element at index pos with one lock and at most one copy.
+        // Throws std::out_of_range if pos > size().
+        template <typename _FwdIt>
+        write_result insert(std::size_t pos, _FwdIt first, _FwdIt last)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (pos > size_unlocked())
+                throw std::out_of_range("cow::vector::insert");
+
+            return insert_unlocked(locker, pos, first, last);
+        }
+
+        // Appends all elements of range (a container, readonly_vector and etc.) with one lock and at most one copy.
+        // Elements of rvalue range are moved.
+        template <typename _Range>
+        write_result append(_Range&& range)
+        {
+            typedef detail::forwarding_iterator<_Range> TIt;
+
+            write_lock locker(_lock, writable_stats(), _notifier);
+            return insert_unlocked(locker, size_unlocked(), TIt(std::begin(range)), TIt(std::end(range)));
+        }
+
+        // Replaces content with the prepared storage, elements are not copied.
+        void assign(TStorage&& storage)
+        {
+            TStoragePtr newStorage;
+            if (!storage.empty())
+                newStorage = std::allocate_shared<TBlock>(_alloc, std::move(storage));
+
+            write_lock locker(_lock, writable_stats(), _notifier);
+            replace(locker, newStorage);
+            publish(locker);
+        }
+
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage || _storage->empty())
+                return 0;
+
+            std::size_t count = 0;
+
+            if (unique()) // nobody holds read-only copy of vector, compact it in one pass
+            {
+                auto it = std::remove_if(_storage->begin(), _storage->end(), predicate);
+                count = std::size_t(_storage->end() - it);
+                if (count == 0) // nothing changed
+                    return 0;
+
+                _storage->erase(it, _storage->end());
+            }
+            else // somebody has a read-only copy
+            {
+                auto it = std::find_if(_storage->begin(), _storage->end(), predicate);
+                if (it == _storage->end()) // nothing changed
+                    return 0;
+
+                TStoragePtr newStorage = allocate(locker, _storage->size() - 1);
+                count = remove_copy(*newStorage, it, predicate, TTrivialSmall());
+                locker.add_copied(newStorage->size());
+
+                if (newStorage->empty())
+                    replace(locker, TStoragePtr());
+                else
+                    replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return count;
+        }
+
+        // Removes leading elements matching predicate found with binary search. Elements must be partitioned
+        // by predicate: all matching ones go first (e.g. sorted by expiry time and predicate tells that an element is expired).
+        template <typename _Pred>
+        std::size_t remove_if_sorted(_Pred predicate)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage || _storage->empty())
+                return 0;
+
+            auto it = std::partition_point(_storage->begin(), _storage->end(), predicate);
+            std::size_t count = std::size_t(it - _storage->begin());
+            if (count == 0)
+                return 0;
+
+            if (it == _storage->end())
+                replace(locker, TStoragePtr());
+            else if (unique()) // nobody holds read-only copy of vector
+                _storage->erase(_storage->begin(), it);
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, _storage->size() - count);
+                newStorage->insert(newStorage->end(), it, _storage->end());
+                locker.add_copied(newStorage->size());
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return count;
+        }
+
+        // Removes elements at strictly ascending indexes (e.g. returned by find_all) in one pass.
+        // Throws std::invalid_argument if indexes are not ascending and std::out_of_range if any of them >= size().
+        template <typename _Range>
+        std::size_t remove_indices(const _Range& indexes)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            auto first = std::begin(indexes);
+            auto last = std::end(indexes);
+            if (first == last)
+                return 0;
+
+            std::size_t size = size_unlocked();
+            std::size_t count = 1;
+            std::size_t prev = *first;
+            for (auto it = std::next(first); it != last; ++it, ++count)
+            {
+                if (std::size_t(*it) <= prev)
+                    throw std::invalid_argument("cow::vector::remove_indices");
+                prev = *it;
+            }
+
+            if (prev >= size)
+                throw std::out_of_range("cow::vector::remove_indices");
+
+            if (count == size)
+                replace(locker, TStoragePtr());
+            else if (unique()) // nobody holds read-only copy of vector, move kept elements over removed ones
+            {
+                auto data = _storage->begin();
+                auto out = data + std::size_t(*first);
+                for (auto it = first; it != last; )
+                {
+                    std::size_t from = std::size_t(*it) + 1;
+                    std::size_t to = ++it == last ? size : std::size_t(*it);
+                    out = std::move(data + from, data + to, out);
+                }
+
+                _storage->erase(out, _storage->end());
+            }
+            else // somebody has a read-only copy, copy runs of kept elements
+            {
+                TStoragePtr newStorage = allocate(locker, size - count);
+                auto data = _storage->begin();
+                std::size_t from = 0;
+                for (auto it = first; it != last; ++it)
+                {
+                    newStorage->insert(newStorage->end(), data + from, data + std::size_t(*it));
+                    from = std::size_t(*it) + 1;
+                }
+                newStorage->insert(newStorage->end(), data + from, _storage->end());
+                locker.add_copied(newStorage->size());
+
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return count;
+        }
+
+        template <typename _Pred>
+        bool removeFirst(_Pred predicate)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage || _storage->empty())
+                return false;
+
+            auto it = std::find_if(_storage->begin(), _storage->end(), predicate);
+            
+            return removeAt(locker, it);
+        }
+
+        template <typename _Pred>
+        bool removeLast(_Pred predicate)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage || _storage->empty())
+                return false;
+
+            auto rit = std::find_if(_storage->rbegin(), _storage->rend(), predicate);
+            if (rit == _storage->rend())
+                return false;
+
+            return removeAt(locker, --rit.base());
+        }
+
+        // Calls func(element) for element at pos under the lock: in place if nobody holds read-only copy,
+        // otherwise on a copy. Throws std::out_of_range if pos >= size(). If func throws on the copy path
+        // the vector is left unchanged.
+        template <typename _Func>
+        write_result update_at(std::size_t pos, _Func func)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (pos >= size_unlocked())
+                throw std::out_of_range("cow::vector::update_at");
+
+            write_result result = write_result::copied;
+            if (unique()) // nobody holds read-only copy of vector
+            {
+                func((*_storage)[pos]);
+                result = write_result::in_place;
+            }
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, _storage->size());
+                newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
+                locker.add_copied(newStorage->size());
+                func((*newStorage)[pos]);
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return result;
+        }
+
+        // Replaces elements matching predicate with value, in place if nobody holds read-only copy.
+        // Returns number of replaced elements, nothing is published if there are no such elements.
+        template <typename _Pred>
+        std::size_t replace_if(_Pred predicate, const T& value)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage)
+                return 0;
+
+            auto it = std::find_if(_storage->begin(), _storage->end(), predicate);
+            if (it == _storage->end()) // nothing changed
+                return 0;
+
+            std::size_t count = 1;
+            if (unique()) // nobody holds read-only copy of vector
+            {
+                for (*it++ = value; it != _storage->end(); ++it)
+                {
+                    if (predicate(*it))
+                    {
+                        *it = value;
+                        ++count;
+                    }
+                }
+            }
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, _storage->size());
+                count = replace_copy(*newStorage, it, predicate, value, TTrivial());
+                locker.add_copied(newStorage->size() - count);
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return count;
+        }
+
+        // Applies any number of modifications in one transaction: the lock is taken once and the data
+        // is copied at most once (only if somebody holds read-only copy). If func throws on the copy path
+        // the vector is left unchanged.
+        template <typename _Func>
+        write_result mutate(_Func func)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            write_result result = write_result::copied;
+            TStoragePtr storage;
+            if (unique()) // nobody holds read-only copy of vector
+            {
+                storage = _storage;
+                result = write_result::in_place;
+            }
+            else // somebody has a read-only copy
+            {
+                storage = allocate(locker, size_unlocked());
+                if (_storage)
+                    storage->insert(storage->end(), _storage->begin(), _storage->end());
+                locker.add_copied(storage->size());
+            }
+
+            func(*storage);
+
+            if (storage->empty())
+                replace(locker, TStoragePtr());
+            else if (storage != _storage)
+                replace(locker, storage);
+
+            publish(locker);
+            return result;
+        }
+
+        // Builds new content from the current one under one lock without copying it implicitly:
+        // func(current, result) fills the empty result and returns false if nothing changes.
+        // The result replaces the storage even if nobody holds read-only copy, so it's for writes
+        // which rewrite everything anyway (merges and etc.). If func throws the vector is left unchanged.
+        template <typename _Func>
+        bool rebuild(_Func func)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            TStorage none(_alloc);
+            locker.copying();
+            TStoragePtr newStorage = detail::make_storage<TBlock>(_alloc, 0);
+            if (!func(_storage ? static_cast<const TStorage&>(*_storage) : none, static_cast<TStorage&>(*newStorage)))
+                return false;
+            locker.add_copied(newStorage->size());
+
+            if (newStorage->empty())
+                replace(locker, TStoragePtr());
+            else
+                replace(locker, newStorage);
+
+            publish(locker);
+            return true;
+        }
+
+        // Makes sure that at least new_capacity elements fit without reallocation.
+        void reserve(std::size_t new_capacity)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage && new_capacity == 0) // nothing to allocate
+                return;
+
+            if (unique()) // nobody holds read-only copy of vector
+                _storage->reserve(new_capacity);
+            else // reserve on a copy, reserved memory of a read-only copy can't be used anyway
+            {
+                locker.copying();
+                TStoragePtr newStorage = detail::make_storage<TBlock>(_alloc, std::max(new_capacity, size_unlocked()));
+                if (_storage)
+                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
+                locker.add_copied(newStorage->size());
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+        }
+
+        // Releases unused capacity.
+        void shrink_to_fit()
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage || _storage->capacity() == _storage->size())
+                return;
+
+            if (_storage->empty())
+                replace(locker, TStoragePtr());
+            else if (unique()) // nobody holds read-only copy of vector
+                _storage->shrink_to_fit();
+            else // somebody has a read-only copy
+            {
+                locker.copying();
+                TStoragePtr newStorage = detail::make_storage<TBlock>(_alloc, _storage->size());
+                newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
+                locker.add_copied(newStorage->size());
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+        }
+
+        std::size_t capacity() const
+        {
+            TStoragePtr storage_copy = copy();
+            return storage_copy ? storage_copy->capacity() : 0;
+        }
+
+        template <typename _Pred>
+        bool exists(_Pred predicate) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy || storage_copy->empty())
+                return false;
+
+            return detail::find_first(storage_copy->data(), storage_copy->size(), predicate, TVectorized<_Pred>()) != storage_copy->size();
+        }
+
+        template <typename _Pred, typename _DefaultValue>
+        T find_first(_Pred predicate, _DefaultValue default_value) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy || storage_copy->empty())
+                return default_value;
+
+            std::size_t pos = detail::find_first(storage_copy->data(), storage_copy->size(), predicate, TVectorized<_Pred>());
+            if (pos == storage_copy->size())
+                return default_value;
+
+            return (*storage_copy)[pos];
+        }
+
+        template <typename _Pred, typename _DefaultValue>
+        T find_last(_Pred predicate, _DefaultValue default_value) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy || storage_copy->empty())
+                return default_value;
+
+            std::size_t pos = detail::find_last(storage_copy->data(), storage_copy->size(), predicate, TVectorized<_Pred>());
+            if (pos == storage_copy->size())
+                return default_value;
+
+            return (*storage_copy)[pos];
+        }
+
+        template <typename _Pred>
+        std::size_t count_if(_Pred predicate) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return 0;
+
+            return detail::count_if(storage_copy->data(), storage_copy->size(), predicate, TVectorized<_Pred>());
+        }
+
+        // Indexes of all elements matching predicate in one snapshot
+        template <typename _Pred>
+        std::vector<std::size_t> find_all(_Pred predicate) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return std::vector<std::size_t>();
+
+            return detail::find_all(storage_copy->data(), storage_copy->size(), predicate, TVectorized<_Pred>());
+        }
+
+#if defined(__cpp_lib_execution)
+        // Overloads running the search on the snapshot with an execution policy (std::execution::par_unseq and etc.),
+        // predicate must be safe to call concurrently
+        template <typename _ExecPolicy, typename _Pred, typename = TIfPolicy<_ExecPolicy>>
+        bool exists(_ExecPolicy&& policy, _Pred predicate) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return false;
+
+            return std::any_of(std::forward<_ExecPolicy>(policy), storage_copy->begin(), storage_copy->end(), predicate);
+        }
+
+        template <typename _ExecPolicy, typename _Pred, typename _DefaultValue, typename = TIfPolicy<_ExecPolicy>>
+        T find_first(_ExecPolicy&& policy, _Pred predicate, _DefaultValue default_value) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return default_value;
+
+            auto it = std::find_if(std::forward<_ExecPolicy>(policy), storage_copy->begin(), storage_copy->end(), predicate);
+            if (it == storage_copy->end())
+                return default_value;
+
+            return *it;
+        }
+
+        template <typename _ExecPolicy, typename _Pred, typename _DefaultValue, typename = TIfPolicy<_ExecPolicy>>
+        T find_last(_ExecPolicy&& policy, _Pred predicate, _DefaultValue default_value) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return default_value;
+
+            auto it = std::find_if(std::forward<_ExecPolicy>(policy), storage_copy->rbegin(), storage_copy->rend(), predicate);
+            if (it == storage_copy->rend())
+                return default_value;
+
+            return *it;
+        }
+
+        template <typename _ExecPolicy, typename _Pred, typename = TIfPolicy<_ExecPolicy>>
+        std::size_t count_if(_ExecPolicy&& policy, _Pred predicate) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return 0;
+
+            return std::size_t(std::count_if(std::forward<_ExecPolicy>(policy), storage_copy->begin(), storage_copy->end(), predicate));
+        }
+
+        template <typename _ExecPolicy, typename _Pred, typename = TIfPolicy<_ExecPolicy>>
+        std::vector<std::size_t> find_all(_ExecPolicy&& policy, _Pred predicate) const
+        {
+            TStoragePtr storage_copy = copy();
+
+            if (!storage_copy)
+                return std::vector<std::size_t>();
+
+            std::vector<char> matched(storage_copy->size());
+            std::transform(std::forward<_ExecPolicy>(policy), storage_copy->begin(), storage_copy->end(), matched.begin(),
+                [&predicate](const T& elem) { return char(predicate(elem) ? 1 : 0); });
+
+            std::vector<std::size_t> indexes;
+            for (std::size_t i = 0; i < matched.size(); ++i)
+                if (matched[i])
+                    indexes.push_back(i);
+
+            return indexes;
+        }
+
+        // Removes elements matching predicate, the predicate is evaluated with the execution policy under the lock
+        template <typename _ExecPolicy, typename _Pred, typename = TIfPolicy<_ExecPolicy>>
+        std::size_t remove(_ExecPolicy&& policy, _Pred predicate)
+        {
+            write_lock locker(_lock, writable_stats(), _notifier);
+
+            if (!_storage || _storage->empty())
+                return 0;
+
+            TStoragePtr storage;
+            if (unique()) // nobody holds read-only copy of vector
+                storage = _storage;
+            else // somebody has a read-only copy
+            {
+                if (std::none_of(policy, _storage->begin(), _storage->end(), predicate)) // otherwise nothing changes
+                    return 0;
+
+                storage = allocate(locker, _storage->size());
+                storage->insert(storage->end(), _storage->begin(), _storage->end());
+                locker.add_copied(storage->size());
+            }
+
+            auto it = std::remove_if(std::forward<_ExecPolicy>(policy), storage->begin(), storage->end(), predicate);
+            std::size_t count = std::size_t(storage->end() - it);
+            if (count == 0)
+                return 0;
+
+            storage->erase(it, storage->end());
+
+            if (storage->empty())
+                replace(locker, TStoragePtr());
+            else if (storage != _storage)
+                replace(locker, storage);
+
+            publish(locker);
+            return count;
+        }
+#endif
+
+        // Iterator which keeps its copy of data alive, so copying it costs reference counting. end() has no storage,
+        // so it can't be decremented and the iterator is declared as an input one although it goes back within its copy.
+        // For algorithms use iterators of read_only_copy(), they are as fast as pointers.
+        class iterator : private TStats::snapshot
+        {
+        public:
+            typedef std::input_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const T* pointer;
+            typedef const T& reference;
+
+            iterator() = default; // constructor for end iterator
+            iterator(const iterator & copy) = default;
+
+            iterator(const TStoragePtr & storage, typename TStorage::const_iterator const& begin, typename TStorage::const_iterator const& end)
+                : _storage(storage)
+                , _it(begin)
+                , _end(end)
+            {
+            }
+
+            iterator(const TStoragePtr & storage, typename TStorage::const_iterator const& begin, typename TStorage::const_iterator const& end, const TStats& stats)
+                : TStats::snapshot(stats)
+                , _storage(storage)
+                , _it(begin)
+                , _end(end)
+            {
+            }
+
+            iterator& operator=(iterator const & right) = default;
+
+            typename TStorage::const_reference operator*() const
+            {
+                return _it.operator*();
+            }
+
+            typename TStorage::const_pointer operator->() const
+            {
+                return _it.operator->();
+            }
+
+            iterator& operator++()
+            {
+                ++_it;
+                return *this;
+            }
+
+            iterator operator++(int)
+            {
+                iterator result = *this;
+                ++_it;
+                return result;
+            }
+
+            // Steps back within the copy, end() can't be decremented
+            iterator& operator--()
+            {
+                --_it;
+                return *this;
+            }
+
+            iterator operator--(int)
+            {
+                iterator result = *this;
+                --_it;
+                return result;
+            }
+
+            // end() has no storage, it's equal to any iterator which reached the end of its copy
+            bool operator==(iterator const & right) const
+            {
+                bool at_end = _it == _end;
+                return at_end == (right._it == right._end) && (at_end || _it == right._it);
+            }
+
+            bool operator!=(iterator const & right) const
+            {	// test for iterator inequality
+                return (!(*this == right));
+            }
+
+        private:
+            TStoragePtr _storage;
+
+            typename TStorage::const_iterator _it;
+            typename TStorage::const_iterator _end;
+        };
+
+        iterator begin() const
+        {
+            TStoragePtr storage_copy = copy();
+            return storage_copy ? iterator(storage_copy, storage_copy->begin(), storage_copy->end(), stats()) : iterator();
+        }
+
+        iterator end() const
+        {
+            return iterator();
+        }
+
+        // Read-only copy for access elements by index and etc.
+        class readonly_vector : private TStats::snapshot
+        {
+        public:
+            // Contiguous iterators of the copy, they are valid while the copy (or any copy of it) is alive
+            typedef typename TStorage::const_iterator const_iterator;
+            typedef typename TStorage::const_reverse_iterator const_reverse_iterator;
+
+            readonly_vector() = delete;
+
+            readonly_vector(const TStoragePtr & storage)
+            {
+                assign(storage);
+            }
+
+            readonly_vector(const TStoragePtr & storage, const TStats& stats)
+                : TStats::snapshot(stats)
+            {
+                assign(storage);
+            }
+
+            readonly_vector(const readonly_vector & copy)
+                : TStats::snapshot(copy)
+            {
+                assign(copy._storage);
+            }
+
+            readonly_vector& operator=(const readonly_vector& _Right)
+            {
+                TStats::snapshot::operator=(_Right);
+                assign(_Right._storage);
+
+                return *this;
+            }
+
+            bool empty() const
+            {
+                return storage().empty();
+            }
+
+            typename TStorage::size_type size() const
+            {
+                return storage().size();
+            }
+
+            typename TStorage::const_reference at(typename TStorage::size_type pos) const
+            {
+                return storage().at(pos);
+            }
+
+            typename TStorage::const_reference operator[](typename TStorage::size_type pos) const
+            {
+                return storage().operator[](pos);
+            }
+
+            typename TStorage::const_reference front() const
+            {
+                return storage().front();
+            }
+
+            typename TStorage::const_reference back() const
+            {
+                return storage().back();
+            }
+
+            const T* data() const
+            {
+                return storage().data();
+            }
+
+            const_iterator begin() const { return storage().begin(); }
+            const_iterator cbegin() const { return storage().cbegin(); }
+            const_iterator end() const { return storage().end(); }
+            const_iterator cend() const { return storage().cend(); }
+
+            const_reverse_iterator rbegin() const { return storage().rbegin(); }
+            const_reverse_iterator crbegin() const { return storage().crbegin(); }
+            const_reverse_iterator rend() const { return storage().rend(); }
+            const_reverse_iterator crend() const { return storage().crend(); }
+
+            operator TStorage const& () const { return storage(); }
+
+        private:
+            void assign(const TStoragePtr & storage)
+            {
+                _storage = storage;
+            }
+
+            // Empty copies have no storage, they read the sentinel which isn't reference counted
+            const TStorage& storage() const
+            {
+                return _storage ? *_storage : _empty_storage;
+            }
+
+            TStoragePtr _storage;
+
+            static const TStorage _empty_storage;
+        };
+
+        readonly_vector read_only_copy() const
+        {
+            return readonly_vector(copy(), stats());
+        }
+
+        const TStats& stats() const
+        {
+            return *this;
+        }
+
+        // Number of writes published so far, it changes after every modification, see cached_reader
+        std::size_t version() const
+        {
+            return _version.load(std::memory_order_acquire);
+        }
+
+        // Sleeps until a write is published after version (see version()) and returns the new version.
+        // It's cheaper than polling read_only_copy(), writers wake waiters after unlocking.
+        std::size_t wait_for_change(std::size_t version) const
+        {
+            return wait_for_change_with(version, [](std::condition_variable& changed, std::unique_lock<std::mutex>& locker) {
+                changed.wait(locker);
+                return true;
+            });
+        }
+
+        // Same with timeout, returns version if nothing was published
+        template <typename _Rep, typename _Period>
+        std::size_t wait_for_change(std::size_t version, const std::chrono::duration<_Rep, _Period>& timeout) const
+        {
+            std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+            return wait_for_change_with(version, [&deadline](std::condition_variable& changed, std::unique_lock<std::mutex>& locker) {
+                return changed.wait_until(locker, deadline) == std::cv_status::no_timeout;
+            });
+        }
+
+        // Calls func(version) after every published write on the writer's thread, outside the lock.
+        // Calls are serialized, versions from concurrent writers may come out of order. func must not throw.
+        subscription subscribe(std::function<void(std::size_t)> func) const
+        {
+            return subscription(&_notifier, _notifier.subscribe(std::move(func)));
+        }
+
+        TLock& lock() const
+        {
+            return _lock;
+        }
+
+        // This method should be called only under lock.
+        // Changes made this way are visible to existing read-only copies and don't change version(), use mutate() instead.
+        TStorage& data()
+        {
+            static_assert(!detail::is_replicated<TReadMode>::value, "changes through data() can't reach replicas of replicated_reads, use mutate()");
+
+            if (!_storage) // we need to create empty array for direct access
+            {
+                _storage = detail::make_storage<TBlock>(_alloc, 0);
+                _published.store(_storage.shared(), replicator{ _alloc });
+            }
+
+            return *_storage;
+        }
+
+    private:
+        TStats& writable_stats()
+        {
+            return *this;
+        }
+
+        // Replaces _storage, the old one is reclaimed after unlocking
+        void replace(write_lock& locker, TStoragePtr storage)
+        {
+            locker.retire(std::move(_storage));
+            _storage = std::move(storage);
+        }
+
+        // Copy of a storage for a group of replicated_reads
+        struct replicator
+        {
+            TSharedPtr operator()(const TBlock& storage, unsigned group) const
+            {
+                TSharedPtr replica = detail::make_storage<TBlock>(read_group_allocator<TAlloc>::get(alloc, group), storage.size());
+                replica->insert(replica->end(), storage.begin(), storage.end());
+                return replica;
+            }
+
+            const TAlloc& alloc;
+        };
+
+        // Makes _storage visible for lock-free readers, bumps the version and counts the write
+        void publish(write_lock& locker)
+        {
+            writable_stats().write(locker.copied() ? write_result::copied : write_result::in_place, locker.copied_count() * sizeof(T));
+            locker.retire(_published.exchange(_storage.shared(), replicator{ _alloc }));
+
+            std::size_t version = _version.load(std::memory_order_relaxed) + 1;
+            _version.store(version, std::memory_order_release);
+            if (_notifier.wanted())
+                locker.published(version);
+        }
+
+        // Counts the waiter under the lock, so either it sees a new version or the next write wakes it
+        template <typename _Deadline>
+        std::size_t wait_for_change_with(std::size_t version, _Deadline deadline) const
+        {
+            {
+                TReadLocker locker(_lock);
+
+                std::size_t current = _version.load(std::memory_order_relaxed);
+                if (current != version)
+                    return current;
+
+                _notifier.waiting();
+            }
+
+            return _notifier.wait(_version, version, deadline);
+        }
+
+        // Creates an empty storage with capacity chosen by TGrowth for required elements, the write is made on a copy
+        TStoragePtr allocate(write_lock& locker, std::size_t required) const
+        {
+            locker.copying();
+            return detail::make_storage<TBlock>(_alloc, TGrowth::capacity(required));
+        }
+
+        // This method should be called only under lock
+        template <typename _FwdIt>
+        write_result insert_unlocked(write_lock& locker, std::size_t pos, _FwdIt first, _FwdIt last)
+        {
+            if (first == last)
+                return write_result::in_place;
+
+            write_result result = write_result::copied;
+            if (unique()) // nobody holds read-only copy of vector
+            {
+                _storage->insert(_storage->begin() + pos, first, last);
+                result = write_result::in_place;
+            }
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, size_unlocked() + std::distance(first, last));
+                if (_storage)
+                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->begin() + pos);
+                newStorage->insert(newStorage->end(), first, last);
+                if (_storage)
+                    newStorage->insert(newStorage->end(), _storage->begin() + pos, _storage->end());
+                locker.add_copied(size_unlocked());
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return result;
+        }
+
+        // This method should be called only under lock.
+        // Fills result with elements kept by predicate, where it is the first removed one. Small trivially
+        // copyable elements are copied at once and compacted in the copy, others are copied by runs of kept ones.
+        // Returns number of removed elements.
+        template <typename _Pred>
+        std::size_t remove_copy(TStorage& result, typename TStorage::iterator it, _Pred& predicate, std::true_type) const
+        {
+            std::size_t pos = std::size_t(it - _storage->begin());
+            result.insert(result.end(), _storage->begin(), it);
+            result.insert(result.end(), it + 1, _storage->end());
+
+            result.erase(std::remove_if(result.begin() + std::ptrdiff_t(pos), result.end(), predicate), result.end());
+            return _storage->size() - result.size();
+        }
+
+        template <typename _Pred>
+        std::size_t remove_copy(TStorage& result, typename TStorage::iterator it, _Pred& predicate, std::false_type) const
+        {
+            std::size_t count = 0;
+            result.insert(result.end(), _storage->begin(), it);
+
+            while (it != _storage->end())
+            {
+                ++count;
+                auto next = std::find_if(++it, _storage->end(), predicate);
+                result.insert(result.end(), it, next);
+                it = next;
+            }
+
+            return count;
+        }
+
+        // This method should be called only under lock.
+        // Fills result with elements where ones matching predicate are replaced by value, it is the first
+        // matching one. Returns number of replaced elements.
+        template <typename _Pred>
+        std::size_t replace_copy(TStorage& result, typename TStorage::iterator it, _Pred& predicate, const T& value, std::true_type) const
+        {
+            std::size_t pos = std::size_t(it - _storage->begin());
+            result.insert(result.end(), _storage->begin(), _storage->end());
+            result[pos] = value;
+
+            std::size_t count = 1;
+            for (std::size_t i = pos + 1; i < result.size(); ++i)
+            {
+                if (predicate(result[i]))
+                {
+                    result[i] = value;
+                    ++count;
+                }
+            }
+
+            return count;
+        }
+
+        template <typename _Pred>
+        std::size_t replace_copy(TStorage& result, typename TStorage::iterator it, _Pred& predicate, const T& value, std::false_type) const
+        {
+            std::size_t count = 1;
+            result.insert(result.end(), _storage->begin(), it);
+            for (result.push_back(value), ++it; it != _storage->end(); ++it)
+            {
+                if (predicate(*it))
+                {
+                    result.push_back(value);
+                    ++count;
+                }
+                else
+                    result.push_back(*it);
+            }
+
+            return count;
+        }
+
+        // This method should be called only under lock
+        std::size_t size_unlocked() const
+        {
+            return _storage ? _storage->size() : 0;
+        }
+
+        TStoragePtr copy() const
+        {
+            if (TPublisher::lock_free_reads) // readers never block on writers
+                return _published.load();
+
+            TReadLocker locker(_lock);
+            return _storage;
+        }
+
+        // This method should be called only under lock.
+        // Lock-free readers can pick up the published storage at any moment, so it's never changed in place.
+        bool unique() const
+        {
+            return !TPublisher::lock_free_reads && _storage.unique();
+        }
+
+        bool removeAt(write_lock& locker, typename TStorage::iterator it)
+        {
+            if (it == _storage->end())
+                return false;
+
+            if (_storage->size() == 1) // it's single element and will remove it
+                replace(locker, TStoragePtr());
+            else if (unique()) // nobody holds read-only copy of vector
+                _storage->erase(it);
+            else // somebody has a read-only copy
+            {
+                TStoragePtr newStorage = allocate(locker, _storage->size() - 1);
+
+                if (it != _storage->begin())
+                    newStorage->insert(newStorage->end(), _storage->begin(), it);
+                if (++it != _storage->end())
+                    newStorage->insert(newStorage->end(), it, _storage->end());
+                locker.add_copied(newStorage->size());
+
+                replace(locker, newStorage);
+            }
+
+            publish(locker);
+            return true;
+        }
+
+    private:
+        TStoragePtr _storage;
+        mutable TLock _lock;
+        TPublisher _published; // copy of _storage for lock-free readers
+        std::atomic<std::size_t> _version{ 0 }; // number of published writes
+        TAlloc _alloc;
+        mutable detail::change_notifier _notifier; // waiters and subscribers, it isn't a part of the content
+    };
+
+    template <typename T, typename TLock, typename TLocker, typename TAlloc, typename TReadMode, typename TGrowth, typename TReclaim, typename TStats>
+    const typename vector<T, TLock, TLocker, TAlloc, TReadMode, TGrowth, TReclaim, TStats>::TStorage vector<T, TLock, TLocker, TAlloc, TReadMode, TGrowth, TReclaim, TStats>::readonly_vector::_empty_storage;
+
+    /**
+     * Read-only copy of a vector which is re-acquired only when the vector's version changes,
+     * so reading an unchanged vector costs one atomic load instead of the lock and the reference counting.
+     * The reader itself is not thread safe, keep one per thread. The held copy pins the storage,
+     * so every write to the vector copies it while a cached_reader exists.
+     */
+    template <typename TVector>
+    class cached_reader
+    {
+    public:
+        typedef typename TVector::readonly_vector readonly_vector;
+
+        explicit cached_reader(const TVector& source)
+            : _source(&source)
+            , _version(source.version())
+            , _copy(source.read_only_copy())
+        {
+        }
+
+        // Copy which includes at least all writes published before the call
+        const readonly_vector& get()
+        {
+            std::size_t version = _source->version();
+            if (version != _version)
+            {
+                _copy = _source->read_only_copy();
+                _version = version;
+            }
+
+            return _copy;
+        }
+
+        const readonly_vector& operator*() { return get(); }
+        const readonly_vector* operator->() { return &get(); }
+
+    private:
+        const TVector* _source;
+        std::size_t _version;
+        readonly_vector _copy;
+    };
+
+    // Kind of a change recorded by tracked_vector
+    enum class change_kind
+    {
+        inserted,
+        removed,
+        reset // everything may have changed, take all elements of the newer copy
+    };
+
+    // Range of elements inserted or removed by a write, pos is an index after the previous changes are applied
+    struct change
+    {
+        change_kind kind;
+        std::size_t pos;
+        std::size_t count;
+    };
+
+    /**
+     * Vector which logs positions of its inserts and removals by version, so a consumer updates its cache
+     * from diff(older, newer) of two read-only copies in O(changes) instead of re-scanning the newer one.
+     * Once changes are applied in order indexes match the newer copy, so inserted elements are taken from it.
+     * The log keeps at most MaxChanges changes, a diff over forgotten ones (or over assign() and mutate())
+     * is a single reset. Writes and read_only_copy() are serialized by a mutex of the tracker,
+     * readers which need no diff can use vector() directly.
+     */
+    template <typename TVector, std::size_t MaxChanges = 1024>
+    class tracked_vector
+    {
+    private:
+        typedef typename TVector::value_type T;
+        typedef std::vector<T, typename TVector::allocator_type> TStorage;
+
+        struct entry
+        {
+            std::size_t version; // version of the write which made the change
+            change what;
+        };
+
+        // Thrown from a write which finds nothing to change, so TVector::mutate doesn't publish it
+        struct unchanged
+        {
+        };
+
+    public:
+        typedef T value_type;
+
+        // Read-only copy which knows version of the vector it was taken at
+        class readonly_vector : public TVector::readonly_vector
+        {
+        public:
+            readonly_vector(const typename TVector::readonly_vector& copy, std::size_t version)
+                : TVector::readonly_vector(copy)
+                , _version(version)
+            {
+            }
+
+            std::size_t version() const
+            {
+                return _version;
+            }
+
+        private:
+            std::size_t _version;
+        };
+
+        write_result push_back(const T& t)
+        {
+            return record([&](TStorage& storage, std::vector<change>& changes) {
+                storage.push_back(t);
+                changes.push_back(change{ change_kind::inserted, storage.size() - 1, 1 });
+            });
+        }
+
+        write_result push_back(T&& t)
+        {
+            return record([&](TStorage& storage, std::vector<change>& changes) {
+                storage.push_back(std::move(t));
+                changes.push_back(change{ change_kind::inserted, storage.size() - 1, 1 });
+            });
+        }
+
+        write_result push_front(const T& t)
+        {
+            return record([&](TStorage& storage, std::vector<change>& changes) {
+                storage.insert(storage.begin(), t);
+                changes.push_back(change{ change_kind::inserted, 0, 1 });
+            });
+        }
+
+        // Throws std::out_of_range if pos > size().
+        template <typename _FwdIt>
+        write_result insert(std::size_t pos, _FwdIt first, _FwdIt last)
+        {
+            return record([&](TStorage& storage, std::vector<change>& changes) {
+                if (pos > storage.size())
+                    throw std::out_of_range("cow::tracked_vector::insert");
+
+                std::size_t size = storage.size();
+                storage.insert(storage.begin() + pos, first, last);
+                if (storage.size() != size)
+                    changes.push_back(change{ change_kind::inserted, pos, storage.size() - size });
+            });
+        }
+
+        // Removes elements matching predicate, every run of adjacent ones is one change
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            std::size_t count = 0;
+            try
+            {
+                record([&](TStorage& storage, std::vector<change>& changes) {
+                    // predicate is checked before anything is moved, so a throwing one leaves the storage intact
+                    for (std::size_t i = 0; i < storage.size(); ++i)
+                    {
+                        if (!predicate(storage[i]))
+                            continue;
+
+                        if (!changes.empty() && changes.back().pos == i - count) // continues the previous run
+                            ++changes.back().count;
+                        else
+                            changes.push_back(change{ change_kind::removed, i - count, 1 });
+                        ++count;
+                    }
+
+                    if (!count) // nothing changes, so mutate is left without publishing
+                        throw unchanged();
+
+                    std::size_t out = changes.front().pos, in = out;
+                    for (const change& run : changes)
+                    {
+                        for (; out != run.pos; ++in, ++out)
+                            storage[out] = std::move(storage[in]);
+                        in += run.count;
+                    }
+                    for (; in != storage.size(); ++in, ++out)
+                        storage[out] = std::move(storage[in]);
+
+                    storage.erase(storage.begin() + out, storage.end());
+                });
+            }
+            catch (const unchanged&)
+            {
+            }
+
+            return count;
+        }
+
+        void clear()
+        {
+            record([](TStorage& storage, std::vector<change>& changes) {
+                if (!storage.empty())
+                    changes.push_back(change{ change_kind::removed, 0, storage.size() });
+                storage.clear();
+            });
+        }
+
+        // Replaces content, the change is a reset
+        void assign(TStorage&& storage)
+        {
+            std::lock_guard<std::mutex> locker(_log_lock);
+            _vector.assign(std::move(storage));
+            reset();
+        }
+
+        // Arbitrary modifications through TVector::mutate, the change is a reset
+        template <typename _Func>
+        write_result mutate(_Func func)
+        {
+            std::lock_guard<std::mutex> locker(_log_lock);
+            write_result result = _vector.mutate(func);
+            reset();
+            return result;
+        }
+
+        readonly_vector read_only_copy() const
+        {
+            std::lock_guard<std::mutex> locker(_log_lock);
+            return readonly_vector(_vector.read_only_copy(), _vector.version());
+        }
+
+        // Changes which turn older copy into newer one. Throws std::invalid_argument if older is newer.
+        std::vector<change> diff(const readonly_vector& older, const readonly_vector& newer) const
+        {
+            if (older.version() > newer.version())
+                throw std::invalid_argument("cow::tracked_vector::diff: copies are in wrong order");
+
+            std::vector<change> changes;
+            std::lock_guard<std::mutex> locker(_log_lock);
+
+            if (older.version() < _base) // the log has forgotten some changes
+                return { change{ change_kind::reset, 0, newer.size() } };
+
+            auto first = std::upper_bound(_log.begin(), _log.end(), older.version(), [](std::size_t version, const entry& e) { return version < e.version; });
+            for (auto it = first; it != _log.end() && it->version <= newer.version(); ++it)
+            {
+                if (it->what.kind == change_kind::reset)
+                    return { change{ change_kind::reset, 0, newer.size() } };
+
+                changes.push_back(it->what);
+            }
+
+            return changes;
+        }
+
+        const TVector& vector() const
+        {
+            return _vector;
+        }
+
+        std::size_t version() const
+        {
+            return _vector.version();
+        }
+
+    private:
+        template <typename _Func>
+        write_result record(_Func func)
+        {
+            std::lock_guard<std::mutex> locker(_log_lock);
+            return write(func);
+        }
+
+        // This method should be called only under lock.
+        // Applies func(storage, changes) with TVector::mutate and logs its changes.
+        template <typename _Func>
+        write_result write(_Func func)
+        {
+            std::vector<change> changes;
+            write_result result = _vector.mutate([&](TStorage& storage) { func(storage, changes); });
+
+            std::size_t version = _vector.version();
+            for (const change& c : changes)
+                _log.push_back(entry{ version, c });
+
+            while (_log.size() > MaxChanges) // forgets the oldest write as a whole
+            {
+                _base = _log.front().version;
+                while (!_log.empty() && _log.front().version == _base)
+                    _log.pop_front();
+            }
+
+            return result;
+        }
+
+        // This method should be called only under lock
+        void reset()
+        {
+            _log.clear();
+            _base = _vector.version() - 1;
+            _log.push_back(entry{ _vector.version(), change{ change_kind::reset, 0, 0 } });
+        }
+
+        TVector _vector;
+        mutable std::mutex _log_lock;
+        std::deque<entry> _log;
+        std::size_t _base = 0; // diff is known for copies taken at this version or later
+    };
+
+    /**
+     * Flat combining front end for concurrent writers of a vector. Every write is queued to a lock-free
+     * list and one of waiting writers (the combiner) applies all queued writes with one mutate(), so a burst
+     * of N writes takes the vector lock once and copies the data at most once instead of N times.
+     * Each write returns when it's published. Writes are applied in order of queueing.
+     * The vector may be used directly at the same time, writes through the combiner are atomic as a batch.
+     */
+    template <typename TVector>
+    class combining_writer
+    {
+    private:
+        typedef typename TVector::value_type T;
+        typedef std::vector<T, typename TVector::allocator_type> TStorage;
+
+        // Queued write, it lives on the stack of the writer which waits for it
+        struct operation
+        {
+            void (*apply)(operation* self, TStorage& storage) = nullptr;
+            operation* next = nullptr;
+            write_result result = write_result::in_place;
+            std::exception_ptr error;
+            std::atomic<bool> done{ false };
+        };
+
+        template <typename _Func>
+        struct typed_operation : operation
+        {
+            explicit typed_operation(_Func& f)
+                : func(f)
+            {
+                this->apply = [](operation* self, TStorage& storage) { static_cast<typed_operation*>(self)->func(storage); };
+            }
+
+            _Func& func;
+        };
+
+    public:
+        explicit combining_writer(TVector& vector)
+            : _vector(vector)
+        {
+        }
+
+        combining_writer(const combining_writer&) = delete;
+        combining_writer& operator=(const combining_writer&) = delete;
+
+        write_result push_back(const T& t)
+        {
+            return apply([&t](TStorage& storage) { storage.push_back(t); });
+        }
+
+        write_result push_back(T&& t)
+        {
+            return apply([&t](TStorage& storage) { storage.push_back(std::move(t)); });
+        }
+
+        template< class... Args>
+        write_result emplace_back(Args&&... args)
+        {
+            return apply([&](TStorage& storage) { storage.emplace_back(std::forward<Args>(args)...); });
+        }
+
+        // Applies func(storage) as a part of a batch. If func throws the exception is rethrown here
+        // and the other writes of the batch are still applied, so func should change nothing before throwing.
+        template <typename _Func>
+        write_result apply(_Func func)
+        {
+            typed_operation<_Func> op(func);
+
+            op.next = _queue.load(std::memory_order_relaxed);
+            while (!_queue.compare_exchange_weak(op.next, &op, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+
+            unsigned spins = 1;
+            while (!op.done.load(std::memory_order_acquire))
+            {
+                if (_combiner.try_lock())
+                {
+                    combine();
+                    _combiner.unlock();
+                }
+                else if (spins <= MaxSpins)
+                {
+                    for (unsigned i = 0; i < spins; ++i)
+                        detail::cpu_relax();
+                    spins *= 2;
+                }
+                else // the combiner is probably preempted
+                    std::this_thread::yield();
+            }
+
+            if (op.error)
+                std::rethrow_exception(op.error);
+
+            return op.result;
+        }
+
+    private:
+        // This method should be called only by the combiner
+        void combine()
+        {
+            operation* list = _queue.exchange(nullptr, std::memory_order_acquire);
+            if (!list)
+                return;
+
+            operation* batch = nullptr; // the queue is LIFO, reverse it to apply writes in order of queueing
+            while (list)
+            {
+                operation* next = list->next;
+                list->next = batch;
+                batch = list;
+                list = next;
+            }
+
+            write_result result = write_result::in_place;
+            try
+            {
+                result = _vector.mutate([batch](TStorage& storage) {
+                    for (operation* op = batch; op; op = op->next)
+                    {
+                        try
+                        {
+                            op->apply(op, storage);
+                        }
+                        catch (...)
+                        {
+                            op->error = std::current_exception();
+                        }
+                    }
+                });
+            }
+            catch (...) // the copy failed, nothing is applied
+            {
+                for (operation* op = batch; op; op = op->next)
+                    op->error = std::current_exception();
+            }
+
+            while (batch) // the writer may leave as soon as done is set
+            {
+                operation* next = batch->next;
+                batch->result = result;
+                batch->done.store(true, std::memory_order_release);
+                batch = next;
+            }
+        }
+
+        static const unsigned MaxSpins = 64;
+
+        TVector& _vector;
+        std::atomic<operation*> _queue{ nullptr };
+        spin_lock _combiner;
+    };
+
+    /**
+     * Write-behind front end of a vector. Writes are queued to a lock-free list and return immediately,
+     * a background thread applies all queued writes with one mutate() every interval or as soon as
+     * max_batch writes are queued. Writers never copy data or wait for the vector lock, readers see
+     * a write at most about interval later. Writes are applied in order of queueing. The thread sleeps
+     * while nothing is queued. Pending writes are applied on destruction.
+     */
+    template <typename TVector>
+    class async_writer
+    {
+    private:
+        typedef typename TVector::value_type T;
+        typedef std::vector<T, typename TVector::allocator_type> TStorage;
+
+        struct operation
+        {
+            virtual ~operation() {}
+            virtual void apply(TStorage& storage) = 0;
+            virtual void complete(write_result result, std::exception_ptr error) = 0;
+
+            operation* next = nullptr;
+        };
+
+        template <typename _Func>
+        struct typed_operation : operation
+        {
+            explicit typed_operation(_Func&& f)
+                : func(std::move(f))
+            {
+            }
+
+            void apply(TStorage& storage) override { func(storage); }
+            void complete(write_result, std::exception_ptr) override {}
+
+            _Func func;
+        };
+
+        template <typename _Func>
+        struct promised_operation : typed_operation<_Func>
+        {
+            explicit promised_operation(_Func&& f)
+                : typed_operation<_Func>(std::move(f))
+            {
+            }
+
+            void complete(write_result result, std::exception_ptr error) override
+            {
+                if (error)
+                    promise.set_exception(error);
+                else
+                    promise.set_value(result);
+            }
+
+            std::promise<write_result> promise;
+        };
+
+    public:
+        explicit async_writer(TVector& vector, std::chrono::microseconds interval = std::chrono::milliseconds(1), std::size_t max_batch = 1024)
+            : _vector(vector)
+            , _interval(interval)
+            , _max_batch(max_batch)
+            , _thread([this] { run(); })
+        {
+        }
+
+        async_writer(const async_writer&) = delete;
+        async_writer& operator=(const async_writer&) = delete;
+
+        ~async_writer()
+        {
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                _stop = true;
+            }
+            _wakeup.notify_one();
+            _thread.join();
+        }
+
+        void push_back(const T& t)
+        {
+            apply([t](TStorage& storage) { storage.push_back(t); });
+        }
+
+        void push_back(T&& t)
+        {
+            apply([t = std::move(t)](TStorage& storage) mutable { storage.push_back(std::move(t)); });
+        }
+
+        template <typename _Pred>
+        void remove(_Pred predicate)
+        {
+            apply([predicate](TStorage& storage) { storage.erase(std::remove_if(storage.begin(), storage.end(), predicate), storage.end()); });
+        }
+
+        // Queues func(storage), exceptions thrown by it are ignored, use submit() to get them
+        template <typename _Func>
+        void apply(_Func func)
+        {
+            enqueue(new typed_operation<_Func>(std::move(func)));
+        }
+
+        // Queues func(storage), the future is ready when the write is published
+        template <typename _Func>
+        std::future<write_result> submit(_Func func)
+        {
+            promised_operation<_Func>* op = new promised_operation<_Func>(std::move(func));
+            std::future<write_result> result = op->promise.get_future();
+            enqueue(op);
+            return result;
+        }
+
+        // Publishes writes queued so far and waits for it
+        void flush()
+        {
+            std::future<write_result> done = submit([](TStorage&) {});
+            {
+                std::lock_guard<std::mutex> locker(_mutex);
+                _flush = true;
+                _wakeup.notify_one();
+            }
+            done.wait();
+        }
+
+    private:
+        void enqueue(operation* op)
+        {
+            // Counted before the thread can take it, so its fetch_sub never runs ahead of this
+            std::size_t queued = _queued.fetch_add(1, std::memory_order_relaxed);
+            bool wake = queued == 0 || queued + 1 == _max_batch; // the idle thread waits for the first one
+
+            op->next = _queue.load(std::memory_order_relaxed);
+            while (!_queue.compare_exchange_weak(op->next, op, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+
+            if (wake)
+            {
+                // Under the mutex, so the thread can't miss it between checking _queued and waiting
+                std::lock_guard<std::mutex> locker(_mutex);
+                _wakeup.notify_one();
+            }
+        }
+
+        void run()
+        {
+            for (;;)
+            {
+                bool stop;
+                {
+                    std::unique_lock<std::mutex> locker(_mutex);
+                    // Sleeps while idle, the interval is counted from the first queued write
+                    _wakeup.wait(locker, [this] { return _stop || _flush || _queued.load(std::memory_order_relaxed) != 0; });
+                    _wakeup.wait_for(locker, _interval, [this] { return _stop || _flush || _queued.load(std::memory_order_relaxed) >= _max_batch; });
+                    stop = _stop;
+                    _flush = false;
+                }
+
+                apply_queued();
+
+                if (stop && !_queue.load(std::memory_order_acquire))
+                    return;
+            }
+        }
+
+        // Applies everything queued with one mutate, this method is called only by the background thread
+        void apply_queued()
+        {
+            operation* list = _queue.exchange(nullptr, std::memory_order_acquire);
+            if (!list)
+                return;
+
+            std::vector<std::unique_ptr<operation>> batch; // the queue is LIFO, reverse it to apply writes in order of queueing
+            for (; list; list = list->next)
+                batch.emplace_back(list);
+            std::reverse(batch.begin(), batch.end());
+            _queued.fetch_sub(batch.size(), std::memory_order_relaxed);
+
+            std::vector<std::exception_ptr> errors(batch.size());
+            write_result result = write_result::in_place;
+            try
+            {
+                result = _vector.mutate([&](TStorage& storage) {
+                    for (std::size_t i = 0; i < batch.size(); ++i)
+                    {
+                        try
+                        {
+                            batch[i]->apply(storage);
+                        }
+                        catch (...)
+                        {
+                            errors[i] = std::current_exception();
+                        }
+                    }
+                });
+            }
+            catch (...) // the copy failed, nothing is applied
+            {
+                std::fill(errors.begin(), errors.end(), std::current_exception());
+            }
+
+            for (std::size_t i = 0; i < batch.size(); ++i)
+                batch[i]->complete(result, errors[i]);
+        }
+
+        TVector& _vector;
+        std::chrono::microseconds _interval;
+        std::size_t _max_batch;
+
+        std::atomic<operation*> _queue{ nullptr };
+        std::atomic<std::size_t> _queued{ 0 };
+
+        std::mutex _mutex;
+        std::condition_variable _wakeup;
+        bool _stop = false;
+        bool _flush = false;
+
+        std::thread _thread; // it's the last member, so everything is initialized before it starts
+    };
+
+    /**
+     * Copy on write vector kept sorted by Compare with unique elements (flat set), lookups are binary searches
+     * on a read-only copy. Writes go through TVector, so locking, read mode and allocation are configured by it.
+     *
+     * @author Alexander Kozlov
+     */
+    template <typename T, typename Compare = std::less<T>, typename TVector = vector<T>>
+    class sorted_vector
+    {
+    private:
+        typedef std::vector<T, typename TVector::allocator_type> TStorage;
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+
+        // Read-only copy with binary search
+        class readonly_vector : public TVector::readonly_vector
+        {
+        public:
+            typedef decltype(std::declval<const typename TVector::readonly_vector&>().begin()) const_iterator;
+
+            readonly_vector(const typename TVector::readonly_vector& copy, const Compare& compare)
+                : TVector::readonly_vector(copy)
+                , _compare(compare)
+            {
+            }
+
+            template <typename _Key>
+            const_iterator lower_bound(const _Key& key) const
+            {
+                return std::lower_bound(this->begin(), this->end(), key, _compare);
+            }
+
+            template <typename _Key>
+            const_iterator upper_bound(const _Key& key) const
+            {
+                return std::upper_bound(this->begin(), this->end(), key, _compare);
+            }
+
+            // Element equivalent to key or end()
+            template <typename _Key>
+            const_iterator find(const _Key& key) const
+            {
+                const_iterator it = lower_bound(key);
+                return it != this->end() && !_compare(key, *it) ? it : this->end();
+            }
+
+            template <typename _Key>
+            bool contains(const _Key& key) const
+            {
+                return find(key) != this->end();
+            }
+
+        private:
+            Compare _compare;
+        };
+
+        sorted_vector() = default;
+
+        explicit sorted_vector(const Compare& compare)
+            : _compare(compare)
+        {
+        }
+
+        void clear()
+        {
+            _vector.clear();
+        }
+
+        // Returns false if an equivalent element is already there
+        bool insert(const T& value)
+        {
+            if (read_only_copy().contains(value)) // common case for lookup tables, don't copy for nothing
+                return false;
+
+            bool inserted = false;
+            _vector.mutate([&](TStorage& storage) {
+                auto it = std::lower_bound(storage.begin(), storage.end(), value, _compare);
+                if (it == storage.end() || _compare(value, *it))
+                {
+                    storage.insert(it, value);
+                    inserted = true;
+                }
+            });
+
+            return inserted;
+        }
+
+        // Merges range into the content with one lock and one copy, returns number of inserted elements
+        template <typename _Range>
+        std::size_t insert_many(const _Range& range)
+        {
+            std::vector<T> batch(std::begin(range), std::end(range));
+            std::sort(batch.begin(), batch.end(), _compare);
+            batch.erase(std::unique(batch.begin(), batch.end(), [this](const T& left, const T& right) { return !_compare(left, right); }), batch.end());
+
+            std::size_t inserted = 0;
+            _vector.rebuild([&](const TStorage& current, TStorage& result) {
+                result.reserve(current.size() + batch.size());
+                std::set_union(current.begin(), current.end(), batch.begin(), batch.end(), std::back_inserter(result), _compare);
+                inserted = result.size() - current.size();
+                return inserted != 0;
+            });
+
+            return inserted;
+        }
+
+        // Removes element equivalent to key, returns false if there is no such element
+        template <typename _Key>
+        bool erase(const _Key& key)
+        {
+            if (!read_only_copy().contains(key))
+                return false;
+
+            bool erased = false;
+            _vector.mutate([&](TStorage& storage) {
+                auto it = std::lower_bound(storage.begin(), storage.end(), key, _compare);
+                if (it != storage.end() && !_compare(key, *it))
+                {
+                    storage.erase(it);
+                    erased = true;
+                }
+            });
+
+            return erased;
+        }
+
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            return _vector.remove(predicate);
+        }
+
+        template <typename _Key>
+        bool contains(const _Key& key) const
+        {
+            return read_only_copy().contains(key);
+        }
+
+        template <typename _Key, typename _DefaultValue>
+        T find(const _Key& key, _DefaultValue default_value) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+
+            auto it = storage_copy.find(key);
+            if (it == storage_copy.end())
+                return default_value;
+
+            return *it;
+        }
+
+        readonly_vector read_only_copy() const
+        {
+            return readonly_vector(_vector.read_only_copy(), _compare);
+        }
+
+        std::size_t version() const
+        {
+            return _vector.version();
+        }
+
+    private:
+        TVector _vector;
+        Compare _compare;
+    };
+
+    /**
+     * Copy on write vector for lists which are small most of the time (e.g. listeners of a connection).
+     * Up to N elements are kept inline: writes change them in place and read-only copies copy them under
+     * the lock, so there is neither allocation nor reference counting. Larger lists are kept in a heap storage
+     * which, as in vector, is changed in place if no read-only copy holds it and copied with TGrowth capacity
+     * otherwise. Reads lock TLock, a spin_lock suits short lists.
+     *
+     * @author Alexander Kozlov
+     */
+    template <typename T, std::size_t N = 4, typename TLock = std::mutex, typename TLocker = std::lock_guard<TLock>, typename TGrowth = geometric_growth<>>
+    class small_vector
+    {
+        static_assert(N > 0, "small_vector needs room for at least one inline element");
+
+    private:
+        typedef std::vector<T> TStorage;
+        typedef detail::counted_storage<TStorage> TBlock;
+        typedef detail::storage_ref<TBlock> TStoragePtr;
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+
+        // Read-only copy, its inline elements are its own and heap storage is shared
+        class readonly_vector
+        {
+        public:
+            typedef const T* const_iterator;
+
+            readonly_vector() = default;
+
+            readonly_vector(const readonly_vector& copy)
+            {
+                assign(copy);
+            }
+
+            readonly_vector& operator=(const readonly_vector& right)
+            {
+                if (this != &right)
+                {
+                    clear();
+                    assign(right);
+                }
+
+                return *this;
+            }
+
+            ~readonly_vector()
+            {
+                clear();
+            }
+
+            bool empty() const { return size() == 0; }
+            size_type size() const { return _heap ? _heap->size() : _size; }
+
+            const T& at(size_type pos) const
+            {
+                if (pos >= size())
+                    throw std::out_of_range("cow::small_vector::readonly_vector::at");
+
+                return data()[pos];
+            }
+
+            const T& operator[](size_type pos) const { return data()[pos]; }
+            const T& front() const { return data()[0]; }
+            const T& back() const { return data()[size() - 1]; }
+
+            const T* data() const { return _heap ? _heap->data() : reinterpret_cast<const T*>(_inline); }
+
+            const_iterator begin() const { return data(); }
+            const_iterator end() const { return data() + size(); }
+
+        private:
+            friend class small_vector;
+
+            T* small() { return reinterpret_cast<T*>(_inline); }
+
+            void assign(const readonly_vector& copy)
+            {
+                if (copy._heap)
+                    _heap = copy._heap;
+                else
+                    assign(copy.begin(), copy.end());
+            }
+
+            // Takes inline copies of at most N elements
+            template <typename _It>
+            void assign(_It first, _It last)
+            {
+                for (; first != last; ++first, ++_size)
+                    new (small() + _size) T(*first);
+            }
+
+            void clear()
+            {
+                while (_size)
+                    small()[--_size].~T();
+                _heap.reset();
+            }
+
+            std::size_t _size = 0; // number of inline elements
+            TStoragePtr _heap;
+            alignas(T) unsigned char _inline[N * sizeof(T)];
+        };
+
+        template <typename... Args>
+        void emplace_back(Args&&... args)
+        {
+            TLocker locker(_lock);
+
+            if (!_current._heap && _current._size < N) // there is inline room
+            {
+                new (_current.small() + _current._size) T(std::forward<Args>(args)...);
+                ++_current._size;
+                return;
+            }
+
+            if (_current._heap.unique()) // nobody holds read-only copy of the heap storage
+            {
+                TStorage& storage = *_current._heap;
+                if (storage.size() == storage.capacity())
+                    storage.reserve(TGrowth::capacity(storage.size() + 1));
+                storage.emplace_back(std::forward<Args>(args)...);
+                return;
+            }
+
+            TStoragePtr storage = allocate(_current.size() + 1);
+            storage->insert(storage->end(), _current.begin(), _current.end());
+            storage->emplace_back(std::forward<Args>(args)...);
+
+            _current.clear();
+            _current._heap = std::move(storage);
+        }
+
+        void push_back(const T& t)
+        {
+            emplace_back(t);
+        }
+
+        void push_back(T&& t)
+        {
+            emplace_back(std::move(t));
+        }
+
+        // Removes elements matching predicate, a list which shrinks to N elements goes back inline
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            TLocker locker(_lock);
+
+            std::size_t count = 0;
+            if (!_current._heap)
+            {
+                T* first = _current.small();
+                T* last = std::remove_if(first, first + _current._size, predicate);
+                count = std::size_t(first + _current._size - last);
+                while (_current._size != std::size_t(last - first))
+                    first[--_current._size].~T();
+
+                return count;
+            }
+
+            if (_current._heap.unique()) // nobody holds read-only copy of the heap storage
+            {
+                TStorage& storage = *_current._heap;
+                auto it = std::remove_if(storage.begin(), storage.end(), predicate);
+                count = std::size_t(storage.end() - it);
+                storage.erase(it, storage.end());
+            }
+            else
+            {
+                TStoragePtr storage = allocate(_current.size());
+                std::copy_if(_current.begin(), _current.end(), std::back_inserter(*storage), [&](const T& t) { return !predicate(t); });
+                count = _current.size() - storage->size();
+                if (count == 0) // nothing changed
+                    return 0;
+
+                _current._heap = std::move(storage);
+            }
+
+            shrink_to_inline();
+            return count;
+        }
+
+        template <typename _Pred>
+        bool removeFirst(_Pred predicate)
+        {
+            TLocker locker(_lock);
+            return removeAt(std::size_t(std::find_if(_current.begin(), _current.end(), predicate) - _current.begin()));
+        }
+
+        template <typename _Pred>
+        bool removeLast(_Pred predicate)
+        {
+            TLocker locker(_lock);
+
+            for (std::size_t i = _current.size(); i > 0; --i)
+                if (predicate(_current[i - 1]))
+                    return removeAt(i - 1);
+
+            return false;
+        }
+
+        void clear()
+        {
+            TLocker locker(_lock);
+            _current.clear();
+        }
+
+        size_type size() const
+        {
+            TLocker locker(_lock);
+            return _current.size();
+        }
+
+        bool empty() const
+        {
+            return size() == 0;
+        }
+
+        template <typename _Pred>
+        bool exists(_Pred predicate) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+            return std::any_of(storage_copy.begin(), storage_copy.end(), predicate);
+        }
+
+        template <typename _Pred, typename _DefaultValue>
+        T find_first(_Pred predicate, _DefaultValue default_value) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+
+            auto it = std::find_if(storage_copy.begin(), storage_copy.end(), predicate);
+            if (it == storage_copy.end())
+                return default_value;
+
+            return *it;
+        }
+
+        template <typename _Pred>
+        std::size_t count_if(_Pred predicate) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+            return std::size_t(std::count_if(storage_copy.begin(), storage_copy.end(), predicate));
+        }
+
+        readonly_vector read_only_copy() const
+        {
+            TLocker locker(_lock);
+            return _current;
+        }
+
+    private:
+        // Heap storage with capacity by TGrowth for required elements
+        static TStoragePtr allocate(std::size_t required)
+        {
+            TStoragePtr storage(std::make_shared<TBlock>());
+            storage->reserve(TGrowth::capacity(required));
+            return storage;
+        }
+
+        // This method should be called only under lock
+        bool removeAt(std::size_t index)
+        {
+            if (index >= _current.size())
+                return false;
+
+            if (!_current._heap)
+            {
+                T* first = _current.small();
+                std::move(first + index + 1, first + _current._size, first + index);
+                first[--_current._size].~T();
+                return true;
+            }
+
+            if (_current._heap.unique()) // nobody holds read-only copy of the heap storage
+                _current._heap->erase(_current._heap->begin() + std::ptrdiff_t(index));
+            else
+            {
+                TStoragePtr storage = allocate(_current.size() - 1);
+                storage->insert(storage->end(), _current.begin(), _current.begin() + index);
+                storage->insert(storage->end(), _current.begin() + index + 1, _current.end());
+                _current._heap = std::move(storage);
+            }
+
+            shrink_to_inline();
+            return true;
+        }
+
+        // This method should be called only under lock.
+        // A heap list which has shrunk to N elements goes back inline. Inline elements are built before
+        // the heap storage is dropped, if a copy throws the list just stays on the heap.
+        void shrink_to_inline() noexcept
+        {
+            if (!_current._heap || _current._heap->size() > N)
+                return;
+
+            TStorage& heap = *_current._heap;
+            bool unique = _current._heap.unique(); // nobody holds read-only copy, elements can be moved out
+            T* first = _current.small();
+            std::size_t built = 0;
+            try
+            {
+                for (; built != heap.size(); ++built)
+                {
+                    if (unique)
+                        new (first + built) T(std::move_if_noexcept(heap[built]));
+                    else
+                        new (first + built) T(heap[built]);
+                }
+            }
+            catch (...)
+            {
+                while (built)
+                    first[--built].~T();
+                return;
+            }
+
+            _current._heap.reset();
+            _current._size = built;
+        }
+
+        mutable TLock _lock;
+        readonly_vector _current;
+    };
+
+    /**
+     * Copy on write vector with structural sharing. Elements are kept in chunks of a 2^Bits-ary trie,
+     * so a write while somebody holds read-only copy copies only nodes on the path to the changed element
+     * instead of the whole array. Synchronization is the same as in vector.
+     * push_back, emplace_back and set are O(log n), push_front and removals are O(n - index).
+     * There is no contiguous data(), elements are accessed by index or iterators.
+     */
+    template <typename T, typename TLock = std::mutex, typename TLocker = std::lock_guard<TLock>, typename TReadMode = locked_reads, std::size_t Bits = 5>
+    class persistent_vector
+    {
+    private:
+        static const std::size_t Width = std::size_t(1) << Bits;
+        static const std::size_t Mask = Width - 1;
+
+        struct node : detail::counted_node
+        {
+            virtual ~node() = default;
+        };
+
+        typedef detail::node_ref<node> TNodePtr;
+
+        struct inner_node : node
+        {
+            TNodePtr children[Width];
+        };
+
+        struct leaf_node : node
+        {
+            std::vector<T> values;
+        };
+
+        // Content of the vector, it's never changed while somebody holds it
+        struct trie
+        {
+            std::size_t size = 0;
+            std::size_t shift = 0; // 0 means root is a leaf
+            TNodePtr root;
+        };
+
+        static_assert(!detail::is_replicated<TReadMode>::value, "replicated_reads is supported only by vector");
+
+        typedef persistent_vector<T, TLock, TLocker, TReadMode, Bits> TVector;
+        typedef detail::counted_storage<trie> TBlock;
+        typedef std::shared_ptr<TBlock> TSharedPtr;
+        typedef detail::storage_ref<TBlock> TStoragePtr;
+        typedef detail::publisher<TSharedPtr, TReadMode> TPublisher;
+        typedef typename read_locker<TLock, TLocker>::type TReadLocker;
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+        typedef const T& const_reference;
+
+        persistent_vector()
+        {
+        }
+
+        persistent_vector(const TLock& lock)
+            : _lock(lock)
+        {
+        }
+
+        persistent_vector(const TVector& array)
+            : _storage(array.copy())
+        {
+            _published.store(_storage.shared());
+        }
+
+        TVector& operator=(const TVector& _Right)
+        {
+            TStoragePtr storage_copy = _Right.copy();
+
+            {
+                TLocker locker(_lock);
+                _storage = storage_copy;
+                _published.store(_storage.shared());
+            }
+
+            return *this;
+        }
+
+        void clear()
+        {
+            TLocker locker(_lock);
+            _storage.reset();
+            _published.store(_storage.shared());
+        }
+
+        void push_front(const T& t)
+        {
+            emplace_front(t);
+        }
+
+        void push_front(T&& t)
+        {
+            emplace_front(std::move(t));
+        }
+
+        void push_back(const T& t)
+        {
+            emplace_back(t);
+        }
+
+        void push_back(T&& t)
+        {
+            emplace_back(std::move(t));
+        }
+
+        template< class... Args>
+        void emplace_front(Args&&... args)
+        {
+            TLocker locker(_lock);
+
+            TStoragePtr newStorage(std::make_shared<TBlock>());
+            append(*newStorage, std::forward<Args>(args)...);
+            if (_storage) // all elements are shifted, so nothing can be shared
+                for (const_iterator it(_storage.get(), 0), end(_storage.get(), _storage->size); it != end; ++it)
+                    append(*newStorage, *it);
+            _storage = newStorage;
+
+            _published.store(_storage.shared());
+        }
+
+        template< class... Args>
+        void emplace_back(Args&&... args)
+        {
+            TLocker locker(_lock);
+            append(writable(), std::forward<Args>(args)...);
+            _published.store(_storage.shared());
+        }
+
+        // Replaces element at index pos, only nodes on the path to it are copied.
+        // Throws std::out_of_range if pos >= size().
+        template <typename _Value>
+        void set(std::size_t pos, _Value&& value)
+        {
+            TLocker locker(_lock);
+
+            if (pos >= size_unlocked())
+                throw std::out_of_range("cow::persistent_vector::set");
+
+            writable_leaf(writable(), pos)->values[pos & Mask] = std::forward<_Value>(value);
+            _published.store(_storage.shared());
+        }
+
+        // Calls func(element) for element at pos, only nodes on the path to it are copied.
+        // Throws std::out_of_range if pos >= size().
+        template <typename _Func>
+        void update_at(std::size_t pos, _Func func)
+        {
+            TLocker locker(_lock);
+
+            if (pos >= size_unlocked())
+                throw std::out_of_range("cow::persistent_vector::update_at");
+
+            func(writable_leaf(writable(), pos)->values[pos & Mask]);
+            _published.store(_storage.shared());
+        }
+
+        // Replaces elements matching predicate with value, only leaves with such elements are copied.
+        // Returns number of replaced elements.
+        template <typename _Pred>
+        std::size_t replace_if(_Pred predicate, const T& value)
+        {
+            TLocker locker(_lock);
+
+            std::size_t size = size_unlocked();
+            std::size_t first = find_index(predicate, 0, size);
+            if (first == size) // nothing changed
+                return 0;
+
+            trie& storage = writable();
+            leaf_node* leaf = writable_leaf(storage, first);
+            leaf->values[first & Mask] = value;
+            std::size_t count = 1;
+
+            for (std::size_t i = first + 1; i < size; i = (i | Mask) + 1) // leaf by leaf
+            {
+                const leaf_node* current = leaf_for(storage, i);
+                std::size_t start = i & Mask;
+                for (std::size_t j = start; j < current->values.size(); ++j)
+                {
+                    if (!predicate(current->values[j]))
+                        continue;
+
+                    if (current != leaf) // the leaf gets its own copy at the first match
+                        current = leaf = writable_leaf(storage, i);
+                    leaf->values[j] = value;
+                    ++count;
+                }
+            }
+
+            _published.store(_storage.shared());
+            return count;
+        }
+
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            TLocker locker(_lock);
+
+            std::size_t size = size_unlocked();
+            std::size_t first = find_index(predicate, 0, size);
+            if (first == size)
+                return 0;
+
+            // elements before the first removed one stay shared, the rest is appended again
+            std::vector<T> rest;
+            for (const_iterator it(_storage.get(), first + 1), end(_storage.get(), size); it != end; ++it)
+                if (!predicate(*it))
+                    rest.push_back(*it);
+
+            std::size_t count = size - first - rest.size();
+
+            trie& storage = writable();
+            truncate(storage, first);
+            for (auto& elem : rest)
+                append(storage, std::move(elem));
+
+            reset_if_empty();
+            _published.store(_storage.shared());
+            return count;
+        }
+
+        template <typename _Pred>
+        bool removeFirst(_Pred predicate)
+        {
+            TLocker locker(_lock);
+
+            std::size_t size = size_unlocked();
+            return removeAt(find_index(predicate, 0, size));
+        }
+
+        template <typename _Pred>
+        bool removeLast(_Pred predicate)
+        {
+            TLocker locker(_lock);
+
+            std::size_t size = size_unlocked();
+            for (std::size_t i = size; i > 0; --i)
+                if (predicate(leaf_for(*_storage, i - 1)->values[(i - 1) & Mask]))
+                    return removeAt(i - 1);
+
+            return false;
+        }
+
+        template <typename _Pred>
+        bool exists(_Pred predicate) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+            return std::find_if(storage_copy.begin(), storage_copy.end(), predicate) != storage_copy.end();
+        }
+
+        template <typename _Pred, typename _DefaultValue>
+        T find_first(_Pred predicate, _DefaultValue default_value) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+
+            auto it = std::find_if(storage_copy.begin(), storage_copy.end(), predicate);
+            if (it == storage_copy.end())
+                return default_value;
+
+            return *it;
+        }
+
+        template <typename _Pred, typename _DefaultValue>
+        T find_last(_Pred predicate, _DefaultValue default_value) const
+        {
+            readonly_vector storage_copy = read_only_copy();
+
+            auto it = std::find_if(storage_copy.rbegin(), storage_copy.rend(), predicate);
+            if (it == storage_copy.rend())
+                return default_value;
+
+            return *it;
+        }
+
+        // Random access iterator over a trie, it doesn't keep the trie alive
+        class const_iterator
+        {
+        public:
+            typedef std::random_access_iterator_tag iterator_category;
+            typedef T value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const T* pointer;
+            typedef const T& reference;
+
+            const_iterator() = default;
+
+            const_iterator(const trie* storage, std::size_t index)
+                : _trie(storage)
+                , _index(index)
+            {
+            }
+
+            reference operator*() const { return leaf()->values[_index & Mask]; }
+            pointer operator->() const { return &operator*(); }
+            reference operator[](difference_type n) const { return *(*this + n); }
+
+            const_iterator& operator++() { ++_index; return *this; }
+            const_iterator operator++(int) { const_iterator result = *this; ++_index; return result; }
+            const_iterator& operator--() { --_index; return *this; }
+            const_iterator operator--(int) { const_iterator result = *this; --_index; return result; }
+
+            const_iterator& operator+=(difference_type n) { _index += n; return *this; }
+            const_iterator& operator-=(difference_type n) { _index -= n; return *this; }
+            const_iterator operator+(difference_type n) const { return const_iterator(*this) += n; }
+            const_iterator operator-(difference_type n) const { return const_iterator(*this) -= n; }
+            friend const_iterator operator+(difference_type n, const_iterator const& it) { return it + n; }
+            difference_type operator-(const_iterator const& right) const { return difference_type(_index - right._index); }
+
+            bool operator==(const_iterator const& right) const { return _index == right._index; }
+            bool operator!=(const_iterator const& right) const { return _index != right._index; }
+            bool operator<(const_iterator const& right) const { return _index < right._index; }
+            bool operator>(const_iterator const& right) const { return _index > right._index; }
+            bool operator<=(const_iterator const& right) const { return _index <= right._index; }
+            bool operator>=(const_iterator const& right) const { return _index >= right._index; }
+
+        private:
+            const leaf_node* leaf() const
+            {
+                if (!_leaf || (_index & ~Mask) != _leaf_start) // moved to another chunk
+                {
+                    _leaf = leaf_for(*_trie, _index);
+                    _leaf_start = _index & ~Mask;
+                }
+
+                return _leaf;
+            }
+
+            const trie* _trie = nullptr;
+            std::size_t _index = 0;
+
+            mutable const leaf_node* _leaf = nullptr;
+            mutable std::size_t _leaf_start = 0;
+        };
+
+        typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+        // Iterator which keeps its copy of data alive, see vector::iterator
+        class iterator
+        {
+        public:
+            iterator() = default; // constructor for end iterator
+
+            iterator(const TStoragePtr & storage)
+                : _storage(storage)
+                , _it(storage.get(), 0)
+                , _end(storage.get(), storage->size)
+            {
+            }
+
+            const T& operator*() const { return *_it; }
+            const T* operator->() const { return _it.operator->(); }
+
+            iterator& operator++() { ++_it; return *this; }
+            iterator operator++(int) { iterator result = *this; ++_it; return result; }
+
+            bool operator==(iterator const & right) const
+            {
+                if (!_storage) // this is end() iterator
+                    return !right._storage || right._it == right._end;
+
+                if (!right._storage) // right value is end()
+                    return _it == _end;
+
+                return _it == right._it;
+            }
+
+            bool operator!=(iterator const & right) const
+            {
+                return (!(*this == right));
+            }
+
+        private:
+            TStoragePtr _storage;
+
+            const_iterator _it;
+            const_iterator _end;
+        };
+
+        iterator begin() const
+        {
+            TStoragePtr storage_copy = copy();
+            return storage_copy ? iterator(storage_copy) : iterator();
+        }
+
+        iterator end() const
+        {
+            return iterator();
+        }
+
+        // Read-only copy for access elements by index and etc.
+        class readonly_vector
+        {
+        public:
+            readonly_vector() = delete;
+
+            readonly_vector(const TStoragePtr & storage)
+                : _storage(storage)
+            {
+            }
+
+            bool empty() const
+            {
+                return size() == 0;
+            }
+
+            size_type size() const
+            {
+                return _storage ? _storage->size : 0;
+            }
+
+            const_reference at(size_type pos) const
+            {
+                if (pos >= size())
+                    throw std::out_of_range("cow::persistent_vector::readonly_vector::at");
+
+                return operator[](pos);
+            }
+
+            const_reference operator[](size_type pos) const
+            {
+                return leaf_for(*_storage, pos)->values[pos & Mask];
+            }
+
+            const_reference front() const
+            {
+                return operator[](0);
+            }
+
+            const_reference back() const
+            {
+                return operator[](size() - 1);
+            }
+
+            const_iterator begin() const { return const_iterator(_storage.get(), 0); }
+            const_iterator cbegin() const { return begin(); }
+            const_iterator end() const { return const_iterator(_storage.get(), size()); }
+            const_iterator cend() const { return end(); }
+
+            const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+            const_reverse_iterator crbegin() const { return rbegin(); }
+            const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+            const_reverse_iterator crend() const { return rend(); }
+
+        private:
+            TStoragePtr _storage;
+        };
+
+        readonly_vector read_only_copy() const
+        {
+            return readonly_vector(copy());
+        }
+
+    private:
+        // Makes node writable, it is copied if somebody else references it
+        template <typename TNode>
+        static TNode* writable(TNodePtr& n)
+        {
+            if (!n)
+                n = TNodePtr(new TNode());
+            else if (!n.unique()) // node is shared with read-only copy
+                n = TNodePtr(new TNode(*static_cast<TNode*>(n.get())));
+
+            return static_cast<TNode*>(n.get());
+        }
+
+        static const leaf_node* leaf_for(const trie& storage, std::size_t index)
+        {
+            const node* n = storage.root.get();
+            for (std::size_t level = storage.shift; level > 0; level -= Bits)
+                n = static_cast<const inner_node*>(n)->children[(index >> level) & Mask].get();
+
+            return static_cast<const leaf_node*>(n);
+        }
+
+        // Copies shared nodes on the path to the element at index
+        static leaf_node* writable_leaf(trie& storage, std::size_t index)
+        {
+            TNodePtr* n = &storage.root;
+            for (std::size_t level = storage.shift; level > 0; level -= Bits)
+                n = &writable<inner_node>(*n)->children[(index >> level) & Mask];
+
+            leaf_node* leaf = writable<leaf_node>(*n);
+            leaf->values.reserve(Width);
+            return leaf;
+        }
+
+        template< class... Args>
+        static void append(trie& storage, Args&&... args)
+        {
+            if (storage.root && storage.size == (Width << storage.shift)) // trie is full, add a level
+            {
+                TNodePtr root(new inner_node());
+                static_cast<inner_node*>(root.get())->children[0] = std::move(storage.root);
+                storage.root = std::move(root);
+                storage.shift += Bits;
+            }
+
+            writable_leaf(storage, storage.size)->values.emplace_back(std::forward<Args>(args)...);
+            ++storage.size;
+        }
+
+        // Drops elements starting from new_size, nodes before it stay shared
+        static void truncate(trie& storage, std::size_t new_size)
+        {
+            if (new_size >= storage.size)
+                return;
+
+            if (new_size == 0)
+            {
+                storage = trie();
+                return;
+            }
+
+            while (storage.shift > 0 && new_size <= (Width << (storage.shift - Bits))) // first child is enough
+            {
+                TNodePtr child = static_cast<inner_node*>(storage.root.get())->children[0];
+                storage.root = std::move(child);
+                storage.shift -= Bits;
+            }
+
+            std::size_t last = new_size - 1;
+            TNodePtr* n = &storage.root;
+            for (std::size_t level = storage.shift; level > 0; level -= Bits)
+            {
+                inner_node* inner = writable<inner_node>(*n);
+                std::size_t index = (last >> level) & Mask;
+                for (std::size_t i = index + 1; i < Width; ++i)
+                    inner->children[i].reset();
+
+                n = &inner->children[index];
+            }
+
+            leaf_node* leaf = writable<leaf_node>(*n);
+            leaf->values.erase(leaf->values.begin() + (last & Mask) + 1, leaf->values.end());
+            storage.size = new_size;
+        }
+
+        // This method should be called only under lock.
+        // Returns trie for modification, it's copied if somebody holds read-only copy.
+        trie& writable()
+        {
+            if (!unique()) // nodes will be copied on demand
+                _storage = TStoragePtr(_storage ? std::make_shared<TBlock>(*_storage) : std::make_shared<TBlock>());
+
+            return *_storage;
+        }
+
+        // This method should be called only under lock.
+        // Lock-free readers can pick up the published trie at any moment, so it's never changed in place.
+        bool unique() const
+        {
+            return !TPublisher::lock_free_reads && _storage.unique();
+        }
+
+        // This method should be called only under lock
+        void reset_if_empty()
+        {
+            if (_storage && _storage->size == 0)
+                _storage.reset();
+        }
+
+        // This method should be called only under lock
+        std::size_t size_unlocked() const
+        {
+            return _storage ? _storage->size : 0;
+        }
+
+        // This method should be called only under lock
+        template <typename _Pred>
+        std::size_t find_index(_Pred& predicate, std::size_t first, std::size_t last) const
+        {
+            if (first == last)
+                return last;
+
+            return std::find_if(const_iterator(_storage.get(), first), const_iterator(_storage.get(), last), predicate) - const_iterator(_storage.get(), 0);
+        }
+
+        // This method should be called only under lock
+        bool removeAt(std::size_t index)
+        {
+            std::size_t size = size_unlocked();
+            if (index >= size)
+                return false;
+
+            std::vector<T> rest(const_iterator(_storage.get(), index + 1), const_iterator(_storage.get(), size));
+
+            trie& storage = writable();
+            truncate(storage, index);
+            for (auto& elem : rest)
+                append(storage, std::move(elem));
+
+            reset_if_empty();
+            _published.store(_storage.shared());
+            return true;
+        }
+
+        TStoragePtr copy() const
+        {
+            if (TPublisher::lock_free_reads) // readers never block on writers
+                return _published.load();
+
+            TReadLocker locker(_lock);
+            return _storage;
+        }
+
+    private:
+        TStoragePtr _storage;
+        mutable TLock _lock;
+        TPublisher _published; // copy of _storage for lock-free readers
+    };
+
+    /**
+     * Copy on write hash map with open addressing (linear probing). Slots are kept in groups of 2^GroupBits
+     * which are shared between copies of the table, so a write while somebody holds read-only copy copies
+     * only the directory and the groups it touches instead of the whole table. Synchronization is the same as in vector.
+     */
+    template <typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>, typename TLock = std::mutex, typename TLocker = std::lock_guard<TLock>, typename TReadMode = locked_reads, std::size_t GroupBits = 4>
+    class unordered_map
+    {
+    public:
+        typedef K key_type;
+        typedef V mapped_type;
+        typedef std::pair<const K, V> value_type;
+        typedef std::size_t size_type;
+
+    private:
+        static const std::size_t GroupSize = std::size_t(1) << GroupBits;
+        static const std::size_t GroupMask = GroupSize - 1;
+        static const std::size_t PageBits = 6;
+        static const std::size_t PageSize = std::size_t(1) << PageBits;
+        static const std::size_t PageMask = PageSize - 1;
+
+        // Control byte of a slot, full slots keep 7 bits of the hash
+        static const unsigned char empty_slot = 0;
+        static const unsigned char deleted_slot = 1;
+        static const unsigned char full_slot = 0x80;
+
+        // Slots of a group, a missing group has only empty slots
+        struct group : detail::counted_node
+        {
+            group() = default;
+
+            group(const group& copy)
+                : detail::counted_node()
+            {
+                try
+                {
+                    for (std::size_t i = 0; i < GroupSize; ++i)
+                    {
+                        if (copy.control[i] & full_slot)
+                            new (slots[i]) value_type(copy.value(i));
+                        control[i] = copy.control[i];
+                    }
+                }
+                catch (...)
+                {
+                    clear();
+                    throw;
+                }
+            }
+
+            group& operator=(const group&) = delete;
+
+            ~group()
+            {
+                clear();
+            }
+
+            value_type& value(std::size_t i) { return *reinterpret_cast<value_type*>(slots[i]); }
+            const value_type& value(std::size_t i) const { return *reinterpret_cast<const value_type*>(slots[i]); }
+
+            void destroy(std::size_t i, unsigned char mark)
+            {
+                value(i).~value_type();
+                control[i] = mark;
+            }
+
+            void clear()
+            {
+                for (std::size_t i = 0; i < GroupSize; ++i)
+                    if (control[i] & full_slot)
+                        destroy(i, empty_slot);
+            }
+
+            unsigned char control[GroupSize] = {};
+            alignas(value_type) unsigned char slots[GroupSize][sizeof(value_type)];
+        };
+
+        typedef detail::node_ref<group> TGroupPtr;
+
+        struct page : detail::counted_node
+        {
+            TGroupPtr groups[PageSize];
+        };
+
+        typedef detail::node_ref<page> TPagePtr;
+
+        // Content of the map, it's never changed while somebody holds it
+        struct table
+        {
+            std::size_t size = 0;
+            std::size_t used = 0; // full and deleted slots
+            std::size_t bits = 0; // capacity is 2^bits
+            std::vector<TPagePtr> pages;
+
+            std::size_t capacity() const { return std::size_t(1) << bits; }
+        };
+
+        static_assert(!detail::is_replicated<TReadMode>::value, "replicated_reads is supported only by vector");
+
+        typedef unordered_map<K, V, Hash, KeyEqual, TLock, TLocker, TReadMode, GroupBits> TMap;
+        typedef detail::counted_storage<table> TBlock;
+        typedef std::shared_ptr<TBlock> TSharedPtr;
+        typedef detail::storage_ref<TBlock> TStoragePtr;
+        typedef detail::publisher<TSharedPtr, TReadMode> TPublisher;
+        typedef typename read_locker<TLock, TLocker>::type TReadLocker;
+
+        // Hash of key spread over all bits, high bits choose the slot, low ones go to the control byte
+        struct hashed
+        {
+            hashed(const Hash& hash, const K& key)
+                : value(std::uint64_t(hash(key)) * 0x9E3779B97F4A7C15ull)
+            {
+            }
+
+            std::size_t home(const table& storage) const { return std::size_t(value >> (64 - storage.bits)); }
+            unsigned char tag() const { return static_cast<unsigned char>(full_slot | (value & 0x7f)); }
+
+            std::uint64_t value;
+        };
+
+    public:
+        unordered_map()
+        {
+        }
+
+        explicit unordered_map(const Hash& hash, const KeyEqual& equal = KeyEqual())
+            : _hash(hash)
+            , _equal(equal)
+        {
+        }
+
+        unordered_map(const TMap& map)
+            : _storage(map.copy())
+            , _hash(map._hash)
+            , _equal(map._equal)
+        {
+            _published.store(_storage.shared());
+        }
+
+        TMap& operator=(const TMap& _Right)
+        {
+            TStoragePtr storage_copy = _Right.copy();
+
+            {
+                TLocker locker(_lock);
+                _storage = storage_copy;
+                _published.store(_storage.shared());
+            }
+
+            return *this;
+        }
+
+        void clear()
+        {
+            TLocker locker(_lock);
+            _storage.reset();
+            _published.store(_storage.shared());
+        }
+
+        // Returns false and leaves the map unchanged if key is already there
+        template <typename _Value>
+        bool insert(const K& key, _Value&& value)
+        {
+            TLocker locker(_lock);
+
+            if (find_slot(key) != npos)
+                return false;
+
+            emplace_unlocked(key, std::forward<_Value>(value));
+            _published.store(_storage.shared());
+            return true;
+        }
+
+        // Returns true if key was inserted and false if the value of existing key was assigned
+        template <typename _Value>
+        bool insert_or_assign(const K& key, _Value&& value)
+        {
+            TLocker locker(_lock);
+
+            std::size_t slot = find_slot(key);
+            if (slot != npos)
+                writable_group(writable(), slot)->value(slot & GroupMask).second = std::forward<_Value>(value);
+            else
+                emplace_unlocked(key, std::forward<_Value>(value));
+
+            _published.store(_storage.shared());
+            return slot == npos;
+        }
+
+        bool erase(const K& key)
+        {
+            TLocker locker(_lock);
+
+            std::size_t slot = find_slot(key);
+            if (slot == npos)
+                return false;
+
+            erase_unlocked(slot);
+            reset_if_empty();
+            _published.store(_storage.shared());
+            return true;
+        }
+
+        // Removes all elements (pairs of key and value) matching predicate
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            TLocker locker(_lock);
+
+            if (!_storage)
+                return 0;
+
+            std::vector<std::size_t> matched;
+            for (const_iterator it(_storage.get(), 0), end(_storage.get(), npos); it != end; ++it)
+                if (predicate(*it))
+                    matched.push_back(it.slot());
+
+            if (matched.empty())
+                return 0;
+
+            for (std::size_t slot : matched)
+                erase_unlocked(slot);
+
+            reset_if_empty();
+            _published.store(_storage.shared());
+            return matched.size();
+        }
+
+        bool contains(const K& key) const
+        {
+            return read_only_copy().contains(key);
+        }
+
+        template <typename _DefaultValue>
+        V find(const K& key, _DefaultValue default_value) const
+        {
+            readonly_map storage_copy = read_only_copy();
+
+            auto it = storage_copy.find(key);
+            if (it == storage_copy.end())
+                return default_value;
+
+            return it->second;
+        }
+
+        // Forward iterator over a table, it doesn't keep the table alive
+        class const_iterator
+        {
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef typename TMap::value_type value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef const value_type* pointer;
+            typedef const value_type& reference;
+
+            const_iterator() = default;
+
+            // Iterator to the first full slot starting from slot, npos is the end
+            const_iterator(const table* storage, std::size_t slot)
+                : _table(storage)
+                , _slot(slot)
+            {
+                skip_free();
+            }
+
+            reference operator*() const { return group_at(*_table, _slot)->value(_slot & GroupMask); }
+            pointer operator->() const { return &operator*(); }
+
+            const_iterator& operator++() { ++_slot; skip_free(); return *this; }
+            const_iterator operator++(int) { const_iterator result = *this; ++*this; return result; }
+
+            bool operator==(const_iterator const& right) const { return _slot == right._slot; }
+            bool operator!=(const_iterator const& right) const { return _slot != right._slot; }
+
+            std::size_t slot() const { return _slot; }
+
+        private:
+            void skip_free()
+            {
+                if (!_table)
+                {
+                    _slot = npos;
+                    return;
+                }
+
+                for (std::size_t capacity = _table->capacity(); _slot < capacity; ++_slot)
+                {
+                    const group* g = group_at(*_table, _slot);
+                    if (!g) // whole group is empty
+                        _slot |= GroupMask;
+                    else if (g->control[_slot & GroupMask] & full_slot)
+                        return;
+                }
+
+                _slot = npos;
+            }
+
+            const table* _table = nullptr;
+            std::size_t _slot = npos;
+        };
+
+        // Iterator which keeps its copy of data alive, see vector::iterator
+        class iterator
+        {
+        public:
+            iterator() = default; // constructor for end iterator
+
+            iterator(const TStoragePtr & storage)
+                : _storage(storage)
+                , _it(storage.get(), 0)
+            {
+            }
+
+            const value_type& operator*() const { return *_it; }
+            const value_type* operator->() const { return _it.operator->(); }
+
+            iterator& operator++() { ++_it; return *this; }
+            iterator operator++(int) { iterator result = *this; ++_it; return result; }
+
+            bool operator==(iterator const & right) const { return _it == right._it; }
+            bool operator!=(iterator const & right) const { return !(*this == right); }
+
+        private:
+            TStoragePtr _storage;
+            const_iterator _it;
+        };
+
+        iterator begin() const
+        {
+            TStoragePtr storage_copy = copy();
+            return storage_copy ? iterator(storage_copy) : iterator();
+        }
+
+        iterator end() const
+        {
+            return iterator();
+        }
+
+        // Read-only copy for lookups and iteration
+        class readonly_map
+        {
+        public:
+            readonly_map() = delete;
+
+            readonly_map(const TStoragePtr & storage, const Hash& hash, const KeyEqual& equal)
+                : _storage(storage)
+                , _hash(hash)
+                , _equal(equal)
+            {
+            }
+
+            bool empty() const
+            {
+                return size() == 0;
+            }
+
+            size_type size() const
+            {
+                return _storage ? _storage->size : 0;
+            }
+
+            const_iterator find(const K& key) const
+            {
+                if (!_storage)
+                    return end();
+
+                std::size_t slot = find_slot(*_storage, key, _hash, _equal);
+                return slot == npos ? end() : const_iterator(_storage.get(), slot);
+            }
+
+            bool contains(const K& key) const
+            {
+                return find(key) != end();
+            }
+
+            // Throws std::out_of_range if there is no such key
+            const V& at(const K& key) const
+            {
+                const_iterator it = find(key);
+                if (it == end())
+                    throw std::out_of_range("cow::unordered_map::readonly_map::at");
+
+                return it->second;
+            }
+
+            const_iterator begin() const { return const_iterator(_storage.get(), 0); }
+            const_iterator cbegin() const { return begin(); }
+            const_iterator end() const { return const_iterator(_storage.get(), npos); }
+            const_iterator cend() const { return end(); }
+
+        private:
+            TStoragePtr _storage;
+            Hash _hash;
+            KeyEqual _equal;
+        };
+
+        readonly_map read_only_copy() const
+        {
+            return readonly_map(copy(), _hash, _equal);
+        }
+
+    private:
+        static const std::size_t npos = std::size_t(-1);
+
+        // Makes node writable, it is copied if somebody else references it
+        template <typename TNode>
+        static TNode* writable(detail::node_ref<TNode>& n)
+        {
+            if (!n)
+                n = detail::node_ref<TNode>(new TNode());
+            else if (!n.unique()) // node is shared with read-only copy
+                n = detail::node_ref<TNode>(new TNode(*n));
+
+            return n.get();
+        }
+
+        static const group* group_at(const table& storage, std::size_t slot)
+        {
+            std::size_t index = slot >> GroupBits;
+            const page* p = storage.pages[index >> PageBits].get();
+            return p ? p->groups[index & PageMask].get() : nullptr;
+        }
+
+        // Copies shared page and group of the slot
+        static group* writable_group(table& storage, std::size_t slot)
+        {
+            std::size_t index = slot >> GroupBits;
+            return writable(writable(storage.pages[index >> PageBits])->groups[index & PageMask]);
+        }
+
+        static unsigned char control_at(const table& storage, std::size_t slot)
+        {
+            const group* g = group_at(storage, slot);
+            return g ? g->control[slot & GroupMask] : empty_slot;
+        }
+
+        // Slot of key or npos, probing stops at the first empty slot
+        static std::size_t find_slot(const table& storage, const K& key, const Hash& hash, const KeyEqual& equal)
+        {
+            if (storage.size == 0)
+                return npos;
+
+            hashed h(hash, key);
+            std::size_t mask = storage.capacity() - 1;
+            for (std::size_t slot = h.home(storage); ; slot = (slot + 1) & mask)
+            {
+                const group* g = group_at(storage, slot);
+                unsigned char control = g ? g->control[slot & GroupMask] : empty_slot;
+                if (control == empty_slot)
+                    return npos;
+
+                if (control == h.tag() && equal(g->value(slot & GroupMask).first, key))
+                    return slot;
+            }
+        }
+
+        // This method should be called only under lock
+        std::size_t find_slot(const K& key) const
+        {
+            return _storage ? find_slot(*_storage, key, _hash, _equal) : npos;
+        }
+
+        // Places a new element to the first free slot of its probe sequence, storage must have a free slot
+        template <typename... Args>
+        void place(table& storage, const K& key, Args&&... args) const
+        {
+            hashed h(_hash, key);
+            std::size_t mask = storage.capacity() - 1;
+            std::size_t slot = h.home(storage);
+            while (control_at(storage, slot) & full_slot)
+                slot = (slot + 1) & mask;
+
+            group* g = writable_group(storage, slot);
+            new (g->slots[slot & GroupMask]) value_type(std::forward<Args>(args)...);
+
+            if (g->control[slot & GroupMask] == empty_slot)
+                ++storage.used;
+            g->control[slot & GroupMask] = h.tag();
+            ++storage.size;
+        }
+
+        // This method should be called only under lock. Key must be absent.
+        template <typename _Value>
+        void emplace_unlocked(const K& key, _Value&& value)
+        {
+            if (!_storage || (_storage->used + 1) * 4 > _storage->capacity() * 3) // keep load factor under 3/4
+                rehash((size_unlocked() + 1) * 2);
+
+            place(writable(), key, key, std::forward<_Value>(value));
+        }
+
+        // This method should be called only under lock
+        void erase_unlocked(std::size_t slot)
+        {
+            table& storage = writable();
+            group* g = writable_group(storage, slot);
+
+            // the slot is needed by probe sequences only if the next one is taken
+            if (control_at(storage, (slot + 1) & (storage.capacity() - 1)) == empty_slot)
+            {
+                g->destroy(slot & GroupMask, empty_slot);
+                --storage.used;
+            }
+            else
+                g->destroy(slot & GroupMask, deleted_slot);
+
+            --storage.size;
+        }
+
+        // This method should be called only under lock.
+        // Moves all elements to a new table for at least count elements, read-only copies keep the old one.
+        void rehash(std::size_t count)
+        {
+            TStoragePtr newStorage(std::make_shared<TBlock>());
+            newStorage->bits = GroupBits;
+            while (newStorage->capacity() * 3 < count * 4)
+                ++newStorage->bits;
+            newStorage->pages.resize(((newStorage->capacity() >> GroupBits) + PageMask) >> PageBits);
+
+            if (_storage)
+                for (const_iterator it(_storage.get(), 0), end(_storage.get(), npos); it != end; ++it)
+                    place(*newStorage, it->first, *it);
+
+            _storage = newStorage;
+        }
+
+        // This method should be called only under lock.
+        // Returns table for modification, it's copied if somebody holds read-only copy.
+        table& writable()
+        {
+            if (!unique()) // pages and groups will be copied on demand
+                _storage = TStoragePtr(std::make_shared<TBlock>(*_storage));
+
+            return *_storage;
+        }
+
+        // This method should be called only under lock.
+        // Lock-free readers can pick up the published table at any moment, so it's never changed in place.
+        bool unique() const
+        {
+            return !TPublisher::lock_free_reads && _storage.unique();
+        }
+
+        // This method should be called only under lock
+        void reset_if_empty()
+        {
+            if (_storage && _storage->size == 0)
+                _storage.reset();
+        }
+
+        // This method should be called only under lock
+        std::size_t size_unlocked() const
+        {
+            return _storage ? _storage->size : 0;
+        }
+
+        TStoragePtr copy() const
+        {
+            if (TPublisher::lock_free_reads) // readers never block on writers
+                return _published.load();
+
+            TReadLocker locker(_lock);
+            return _storage;
+        }
+
+    private:
+        TStoragePtr _storage;
+        mutable TLock _lock;
+        TPublisher _published; // copy of _storage for lock-free readers
+        Hash _hash;
+        KeyEqual _equal;
+    };
+
+    /**
+     * Padded layout for containers kept in arrays (one per shard and etc.): each object starts on its own
+     * cache line and takes whole lines, so locks and storage pointers of neighbours don't ping-pong.
+     */
+    template <typename TVector>
+    class alignas(cache_line_size) padded : public TVector
+    {
+    public:
+        using TVector::TVector;
+
+        padded() = default;
+    };
+
+    /**
+     * Container which stripes elements across N independently locked vectors, so writers from different
+     * threads don't contend on one lock. push_back goes to the shard of the calling thread, other operations
+     * visit shards in order. Snapshot of every shard is consistent, but shards are copied one by one,
+     * so readonly_vector is not an atomic snapshot of all shards.
+     */
+    template <typename T, std::size_t N, typename TVector = vector<T>>
+    class sharded_vector
+    {
+        static_assert(N > 0, "sharded_vector needs at least one shard");
+
+    private:
+        typedef typename TVector::readonly_vector TShardCopy;
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+
+        static const std::size_t shards = N;
+
+        TVector& shard(std::size_t index)
         {
+            return _shards[index];
         }
 
-        void clear()
+        const TVector& shard(std::size_t index) const
         {
-            TLocker locker(_lock);
-            _storage.reset();
+            return _shards[index];
         }
 
-        TVector& operator=(const TVector& _Right)
+        // Shard used by the calling thread
+        TVector& local_shard()
         {
-            TStoragePtr storage_copy = _Right.copy();
-
-            {
-                TLocker locker(_lock);
-                _storage = storage_copy;
-            }
-
-            return *this;
+            static thread_local const std::size_t index = std::hash<std::thread::id>()(std::this_thread::get_id());
+            return _shards[index % N];
         }
 
-        void push_front(const T& t)
+        void clear()
         {
-            TLocker locker(_lock);
-
-            if (_storage.use_count() == 1) // nobody holds read-only copy of vector
-                _storage->insert(_storage->begin(), t);
-            else // somebody has a read-only copy
-            {
-                TStoragePtr newStorage = TStoragePtr(new TStorage());
-
-                if (!_storage)
-                {
-                    newStorage->reserve(4);
-                    newStorage->push_back(t);
-                }
-                else // copy everything
-                {
-                    newStorage->reserve(_storage->size() + 1 + 4/*reserve additional elements*/);
-                    newStorage->push_back(t);
-                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
-                }
-                _storage = newStorage;
-            }
+            for (auto& shard : _shards)
+                shard.clear();
         }
 
-        void push_back(const T& t)
+        template <typename _Value>
+        void push_back(_Value&& value)
         {
-            TLocker locker(_lock);
-
-            if (_storage.use_count() == 1) // nobody holds read-only copy of vector
-                _storage->push_back(t);
-            else // somebody has a read-only copy
-            {
-                TStoragePtr newStorage = TStoragePtr(new TStorage());
-                if (!_storage)
-                    newStorage->reserve(4);
-                else // copy everything
-                {
-                    newStorage->reserve(_storage->size() + 1 + 4/*reserve additional elements*/);
-                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
-                }
-                newStorage->push_back(t);
-                _storage = newStorage;
-            }
+            local_shard().push_back(std::forward<_Value>(value));
         }
 
         template< class... Args>
         void emplace_back(Args&&... args)
         {
-            TLocker locker(_lock);
-
-            if (_storage.use_count() == 1) // nobody holds read-only copy of vector
-                _storage->emplace_back(_STD forward<Args>(args)...);
-            else // somebody has a read-only copy
-            {
-                TStoragePtr newStorage = TStoragePtr(new TStorage());
-                if (!_storage)
-                    newStorage->reserve(4);
-                else // copy everything
-                {
-                    newStorage->reserve(_storage->size() + 1 + 4/*reserve additional elements*/);
-                    newStorage->insert(newStorage->end(), _storage->begin(), _storage->end());
-                }
-                newStorage->emplace_back(_STD forward<Args>(args)...);
-                _storage = newStorage;
-            }
+            local_shard().emplace_back(std::forward<Args>(args)...);
         }
 
         template <typename _Pred>
         std::size_t remove(_Pred predicate)
         {
-            TLocker locker(_lock);
-
-            if (!_storage || _storage->empty())
-                return 0;
-
             std::size_t count = 0;
-
-            if (_storage.use_count() == 1) // nobody holds read-only copy of vector
-            {
-                for (auto it = _storage->begin(); it != _storage->end(); )
-                {
-                    if (!predicate(*it))
-                        ++it;
-                    else
-                    {
-                        it = _storage->erase(it);
-                        ++count;
-                    }
-                }
-            }
-            else // somebody has a read-only copy
-            {
-                TStoragePtr newStorage = TStoragePtr(new TStorage());
-                newStorage->reserve(_storage->size());
-
-                for (auto const& elem : *_storage)
-                {
-                    if (predicate(elem))
-                        ++count;
-                    else
-                        newStorage->push_back(elem);
-                }
-
-                if (_storage->size() == newStorage->size()) // otherwise nothing changed
-                    return count;
-
-                if (newStorage->empty())
-                    _storage.reset();
-                else
-                    _storage = newStorage;
-            }
+            for (auto& shard : _shards)
+                count += shard.remove(predicate);
 
             return count;
         }
@@ -174,41 +5236,28 @@ namespace cow
         template <typename _Pred>
         bool removeFirst(_Pred predicate)
         {
-            TLocker locker(_lock);
-
-            if (!_storage || _storage->empty())
-                return false;
+            for (auto& shard : _shards)
+                if (shard.removeFirst(predicate))
+                    return true;
 
-            auto it = std::find_if(_storage->begin(), _storage->end(), predicate);
-            
-            return removeAt(it);
+            return false;
         }
 
         template <typename _Pred>
         bool removeLast(_Pred predicate)
         {
-            TLocker locker(_lock);
-
-            if (!_storage || _storage->empty())
-                return false;
-
-            auto rit = std::find_if(_storage->rbegin(), _storage->rend(), predicate);
-            if (rit == _storage->rend())
-                return false;
+            for (std::size_t i = N; i > 0; --i)
+                if (_shards[i - 1].removeLast(predicate))
+                    return true;
 
-            return removeAt(--rit.base());
+            return false;
         }
 
         template <typename _Pred>
         bool exists(_Pred predicate) const
         {
-            TStoragePtr storage_copy = copy();
-
-            if (!storage_copy || _storage->empty())
-                return false;
-
-            for (auto const& elem : *storage_copy)
-                if (predicate(elem))
+            for (auto const& shard : _shards)
+                if (shard.exists(predicate))
                     return true;
 
             return false;
@@ -217,261 +5266,153 @@ namespace cow
         template <typename _Pred, typename _DefaultValue>
         T find_first(_Pred predicate, _DefaultValue default_value) const
         {
-            TStoragePtr storage_copy = copy();
+            readonly_vector storage_copy = read_only_copy();
 
-            if (!storage_copy || _storage->empty())
+            auto it = std::find_if(storage_copy.begin(), storage_copy.end(), predicate);
+            if (it == storage_copy.end())
                 return default_value;
 
-            for (auto const& elem : *storage_copy)
-                if (predicate(elem))
-                    return elem;
-
-            return default_value;
+            return *it;
         }
 
         template <typename _Pred, typename _DefaultValue>
         T find_last(_Pred predicate, _DefaultValue default_value) const
         {
-            TStoragePtr storage_copy = copy();
-
-            if (!storage_copy || _storage->empty())
-                return default_value;
+            for (std::size_t i = N; i > 0; --i)
+            {
+                TShardCopy storage_copy = _shards[i - 1].read_only_copy();
 
-            for (auto it = storage_copy->rbegin(); it != storage_copy->rend(); ++it)
-                if (predicate(*it))
+                auto it = std::find_if(storage_copy.rbegin(), storage_copy.rend(), predicate);
+                if (it != storage_copy.rend())
                     return *it;
+            }
 
             return default_value;
         }
 
-        class iterator
+        // Merged read-only copy of all shards, elements of shard 0 go first
+        class readonly_vector
         {
         public:
-            iterator() = default; // constructor for end iterator
-            iterator(const iterator & copy) = default;
-
-            iterator(const TStoragePtr & storage, typename TStorage::const_iterator const& begin, typename TStorage::const_iterator const& end)
-                : _storage(storage)
-                , _it(begin)
-                , _end(end)
-            {
-            }
-
-            iterator& operator=(iterator const & right) = default;
-
-            typename TStorage::const_reference operator*() const
-            {
-                return _it.operator*();
-            }
-
-            typename TStorage::pointer operator->() const
-            {
-                return _it.operator->();
-            }
-
-            iterator& operator++()
+            // Forward iterator over shards, it doesn't keep the copy alive
+            class const_iterator
             {
-                ++_it;
-                return *this;
-            }
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef T value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const T* pointer;
+                typedef const T& reference;
 
-            iterator operator++(int)
-            {
-                _it++;
-                return *this;
-            }
+                const_iterator() = default;
 
-            iterator& operator--()
-            {
-                --_it;
-                return *this;
-            }
+                const_iterator(const readonly_vector* copy, std::size_t shard, std::size_t pos)
+                    : _copy(copy)
+                    , _shard(shard)
+                    , _pos(pos)
+                {
+                    skip_empty();
+                }
 
-            iterator operator--(int)
-            {
-                _it--;
-                return *this;
-            }
+                reference operator*() const { return _copy->_shards[_shard][_pos]; }
+                pointer operator->() const { return &operator*(); }
 
-            bool operator==(iterator const & right) const
-            {
-                if (!_storage) // this is end() iterator
+                const_iterator& operator++()
                 {
-                    if (!right._storage) // right value is also end()
-                        return true;
-
-                    return right._end == right._it;
+                    ++_pos;
+                    skip_empty();
+                    return *this;
                 }
-                else // this is usual iterator
-                {
-                    if (!right._storage) // right value is end()
-                        return _it == _end;
 
-                    return _it == right._it;
+                const_iterator operator++(int)
+                {
+                    const_iterator result = *this;
+                    ++*this;
+                    return result;
                 }
-            }
-
-            bool operator!=(iterator const & right) const
-            {	// test for iterator inequality
-                return (!(*this == right));
-            }
-
-        private:
-            TStoragePtr _storage;
-
-            typename TStorage::const_iterator _it;
-            typename TStorage::const_iterator _end;
-        };
-
-        iterator begin() const
-        {
-            TLocker locker(_lock);
-            return _storage ? iterator(_storage, _storage->begin(), _storage->end()) : iterator();
-        }
-
-        iterator end() const
-        {
-            return iterator();
-        }
-
-        // Read-only copy for access elements by index and etc.
-        class readonly_vector
-        {
-        public:
-            readonly_vector() = delete;
-
-            readonly_vector(const TStoragePtr & storage)
-            {
-                assign(storage);
-            }
 
-            readonly_vector(const readonly_vector & copy)
-            {
-                assign(copy._storage);
-            }
+                bool operator==(const_iterator const& right) const { return _shard == right._shard && _pos == right._pos; }
+                bool operator!=(const_iterator const& right) const { return !(*this == right); }
 
-            readonly_vector& operator=(const readonly_vector& _Right)
-            {
-                assign(_Right._storage);
+            private:
+                void skip_empty()
+                {
+                    while (_shard < N && _pos == _copy->_shards[_shard].size())
+                    {
+                        ++_shard;
+                        _pos = 0;
+                    }
+                }
 
-                return *this;
-            }
+                const readonly_vector* _copy = nullptr;
+                std::size_t _shard = N;
+                std::size_t _pos = 0;
+            };
 
             bool empty() const
             {
-                return _storage->empty();
+                return size() == 0;
             }
 
-            typename TStorage::size_type size() const
+            size_type size() const
             {
-                return _storage->size();
+                return _offsets[N];
             }
 
-            typename TStorage::const_reference at(typename TStorage::size_type pos) const
+            const T& at(size_type pos) const
             {
-                return _storage->at(pos);
-            }
+                if (pos >= size())
+                    throw std::out_of_range("cow::sharded_vector::readonly_vector::at");
 
-            typename TStorage::const_reference operator[](typename TStorage::size_type pos) const
-            {
-                return _storage->operator[](pos);
+                return operator[](pos);
             }
 
-            typename TStorage::const_reference front() const
+            const T& operator[](size_type pos) const
             {
-                return _storage->front();
+                std::size_t shard = std::upper_bound(_offsets.begin(), _offsets.end(), pos) - _offsets.begin() - 1;
+                return _shards[shard][pos - _offsets[shard]];
             }
 
-            typename TStorage::const_reference back() const
-            {
-                return _storage->back();
-            }
+            const T& front() const { return *begin(); }
+            const T& back() const { return operator[](size() - 1); }
 
-            const T* data() const
+            const_iterator begin() const { return const_iterator(this, 0, 0); }
+            const_iterator cbegin() const { return begin(); }
+            const_iterator end() const { return const_iterator(this, N, 0); }
+            const_iterator cend() const { return end(); }
+
+            const TShardCopy& shard(std::size_t index) const
             {
-                return _storage->data();
+                return _shards[index];
             }
 
-            typename TStorage::const_iterator begin() const { return _storage->begin(); }
-            typename TStorage::const_iterator cbegin() const { return _storage->cbegin(); }
-            typename TStorage::const_iterator end() const { return _storage->end(); }
-            typename TStorage::const_iterator cend() const { return _storage->cend(); }
-
-            typename TStorage::const_iterator rbegin() const { return _storage->rbegin(); }
-            typename TStorage::const_iterator crbegin() const { return _storage->crbegin(); }
-            typename TStorage::const_iterator rend() const { return _storage->rend(); }
-            typename TStorage::const_iterator crend() const { return _storage->crend(); }
-
-            operator TStorage const& () const { return *_storage; }
-
         private:
-            void assign(const TStoragePtr & storage)
+            friend class sharded_vector;
+
+            readonly_vector(std::array<TShardCopy, N>&& shards)
+                : _shards(std::move(shards))
             {
-                _storage = !storage ? _empty_storage : storage;
+                _offsets[0] = 0;
+                for (std::size_t i = 0; i < N; ++i)
+                    _offsets[i + 1] = _offsets[i] + _shards[i].size();
             }
 
-            TStoragePtr _storage;
-
-            static TStoragePtr _empty_storage;
+            std::array<TShardCopy, N> _shards;
+            std::array<std::size_t, N + 1> _offsets;
         };
 
         readonly_vector read_only_copy() const
         {
-            TLocker locker(_lock);
-            return readonly_vector(_storage);
-        }
-
-        TLock& lock() const
-        {
-            return _lock;
-        }
-
-        // This method should be called only under lock
-        TStorage& data()
-        {
-            if (!_storage) // we need to create empty array for direct access
-                _storage = TStoragePtr(new TStorage());
-
-            return *_storage;
+            return readonly_vector(copy(std::make_index_sequence<N>()));
         }
 
     private:
-        TStoragePtr copy() const
-        {
-            TLocker locker(_lock);
-            return _storage;
-        }
-
-        bool removeAt(typename TStorage::iterator it)
+        template <std::size_t... I>
+        std::array<TShardCopy, N> copy(std::index_sequence<I...>) const
         {
-            if (it == _storage->end())
-                return false;
-
-            if (_storage->size() == 1) // it's single element and will remove it
-                _storage.reset();
-            else if (_storage.use_count() == 1) // nobody holds read-only copy of vector
-                _storage->erase(it);
-            else // somebody has a read-only copy
-            {
-                TStoragePtr newStorage = TStoragePtr(new TStorage());
-                newStorage->reserve(_storage->size());
-
-                if (it != _storage->begin())
-                    newStorage->insert(newStorage->end(), _storage->begin(), it);
-                if (++it != _storage->end())
-                    newStorage->insert(newStorage->end(), it, _storage->end());
-
-                _storage = newStorage;
-            }
-
-            return true;
+            return {{ _shards[I].read_only_copy()... }};
         }
 
-    private:
-        TStoragePtr _storage;
-        mutable TLock _lock;
+        padded<TVector> _shards[N];
     };
-
-    template <typename T, typename TLock, typename TLocker, typename TAlloc>
-    typename vector<T, TLock, TLocker, TAlloc>::TStoragePtr vector<T, TLock, TLocker, TAlloc>::readonly_vector::_empty_storage = std::make_shared< vector<T, TLock, TLocker, TAlloc>::TStorage >();
 }
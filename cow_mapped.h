@@ -0,0 +1,620 @@
+#pragma once
+
+#include "cow.h"
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <ostream>
+#include <string>
+#include <system_error>
+
+#if defined(_WIN32)
+#error "cow_mapped.h supports POSIX systems only"
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cow
+{
+    /**
+     * Memory mapping of a POSIX shared memory object or a file, it's unmapped on destruction.
+     * Several processes map the same region to share a shared_vector.
+     */
+    class mapped_region
+    {
+    public:
+        // Creates shared memory object name (e.g. "/my_table") of size bytes, fails if it exists
+        static std::shared_ptr<mapped_region> create_shared(const std::string& name, std::size_t size)
+        {
+            return std::shared_ptr<mapped_region>(new mapped_region(::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600), size, true, "shm_open"));
+        }
+
+        static std::shared_ptr<mapped_region> open_shared(const std::string& name)
+        {
+            return std::shared_ptr<mapped_region>(new mapped_region(::shm_open(name.c_str(), O_RDWR, 0), 0, true, "shm_open"));
+        }
+
+        static void unlink_shared(const std::string& name)
+        {
+            ::shm_unlink(name.c_str());
+        }
+
+        // Creates file path of size bytes, fails if it exists
+        static std::shared_ptr<mapped_region> create_file(const std::string& path, std::size_t size)
+        {
+            return std::shared_ptr<mapped_region>(new mapped_region(::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600), size, true, "open"));
+        }
+
+        // Maps existing file path, a read-only region can be used only for reading (e.g. by load_mapped)
+        static std::shared_ptr<mapped_region> open_file(const std::string& path, bool read_only = false)
+        {
+            return std::shared_ptr<mapped_region>(new mapped_region(::open(path.c_str(), read_only ? O_RDONLY : O_RDWR), 0, !read_only, "open"));
+        }
+
+        mapped_region(const mapped_region&) = delete;
+        mapped_region& operator=(const mapped_region&) = delete;
+
+        ~mapped_region()
+        {
+            if (_base)
+                ::munmap(_base, _size);
+        }
+
+        char* base() const { return static_cast<char*>(_base); }
+        std::size_t size() const { return _size; }
+
+        // True if the region was created (and zero filled) by this mapping
+        bool created() const { return _created; }
+
+    private:
+        // Maps descriptor fd, size is 0 to map an existing object as a whole
+        mapped_region(int fd, std::size_t size, bool writable, const char* what)
+            : _created(size != 0)
+        {
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), what);
+
+            struct stat info;
+            const char* failed = nullptr;
+            if (_created && ::ftruncate(fd, off_t(size)) != 0)
+                failed = "ftruncate";
+            else if (::fstat(fd, &info) != 0)
+                failed = "fstat";
+
+            if (failed)
+            {
+                int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), failed);
+            }
+
+            _size = std::size_t(info.st_size);
+            _base = _size ? ::mmap(nullptr, _size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+            int error = errno;
+            ::close(fd);
+
+            if (_base == MAP_FAILED)
+                throw std::system_error(error, std::generic_category(), "mmap");
+        }
+
+        void* _base = nullptr;
+        std::size_t _size = 0;
+        bool _created;
+    };
+
+    namespace detail
+    {
+        /**
+         * Process-shared mutex which lives in a mapped region. It's robust: if its owner dies, the next lock()
+         * takes it over and goes on with what the owner left, so other processes don't deadlock.
+         */
+        class robust_mutex
+        {
+        public:
+            // Called once by the process which creates the region
+            void init()
+            {
+                pthread_mutexattr_t attributes;
+                ::pthread_mutexattr_init(&attributes);
+                ::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+                ::pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+                int error = ::pthread_mutex_init(&_mutex, &attributes);
+                ::pthread_mutexattr_destroy(&attributes);
+
+                if (error)
+                    throw std::system_error(error, std::generic_category(), "pthread_mutex_init");
+            }
+
+            void lock()
+            {
+                int error = lock_nothrow();
+                if (error)
+                    throw std::system_error(error, std::generic_category(), "pthread_mutex_lock");
+            }
+
+            // Returns the error of locking, the mutex is locked only if it's 0
+            int lock_nothrow() noexcept
+            {
+                int error = ::pthread_mutex_lock(&_mutex);
+                if (error == EOWNERDEAD) // the owner died under lock
+                {
+                    error = ::pthread_mutex_consistent(&_mutex);
+                    if (error)
+                        ::pthread_mutex_unlock(&_mutex);
+                }
+
+                return error;
+            }
+
+            void unlock()
+            {
+                ::pthread_mutex_unlock(&_mutex);
+            }
+
+        private:
+            pthread_mutex_t _mutex;
+        };
+    }
+
+    /**
+     * Copy on write vector of trivially copyable records kept in a mapped_region, so a writer process
+     * publishes and reader processes get zero-copy read-only copies. Storages are addressed by offsets
+     * in the region and have a process-shared count of holders, read-only copies are taken under
+     * a robust process-shared mutex which lives in the region too (during a few instructions).
+     * Storages are allocated from the region (first fit from freed ones), std::bad_alloc is thrown if it's full.
+     * Storages held by a process which crashed (or released when locking failed) are never freed, and a write
+     * in place (remove() without read-only copies) may be left half done if the writer crashes during it.
+     */
+    template <typename T, typename TGrowth = geometric_growth<>>
+    class shared_vector
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "shared_vector keeps only trivially copyable records");
+        static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_BOOL_LOCK_FREE == 2, "process-shared atomics must be lock free");
+
+    private:
+        static const std::uint64_t Magic = 0x636f772d6d617032ull; // "cow-map2"
+        static const std::size_t Align = alignof(std::max_align_t) > alignof(T) ? alignof(std::max_align_t) : alignof(T);
+
+        // Start of the region, fields other than lock are changed only under lock
+        struct region_header
+        {
+            std::uint64_t magic;
+            std::uint64_t element_size;
+            detail::robust_mutex lock;
+            std::uint64_t published; // offset of the current storage, 0 if the vector is empty
+            std::uint64_t top;       // offset of never allocated memory
+            std::uint64_t free_list; // offset of the first freed storage
+        };
+
+        struct block
+        {
+            std::atomic<std::uint32_t> holders; // read-only copies and the region itself for the published one
+            std::uint64_t size;
+            std::uint64_t capacity;
+            std::uint64_t next_free;
+        };
+
+        static std::size_t aligned(std::size_t size)
+        {
+            return (size + Align - 1) / Align * Align;
+        }
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+
+        // Uses the region, it's initialized if it was just created
+        explicit shared_vector(std::shared_ptr<mapped_region> region)
+            : _region(std::move(region))
+        {
+            if (_region->size() < aligned(sizeof(region_header)))
+                throw std::invalid_argument("cow::shared_vector: region is too small");
+
+            region_header* header = this->header();
+            if (_region->created())
+            {
+                header->lock.init();
+                header->element_size = sizeof(T);
+                header->published = 0;
+                header->top = aligned(sizeof(region_header));
+                header->free_list = 0;
+                reinterpret_cast<std::atomic<std::uint64_t>*>(&header->magic)->store(Magic, std::memory_order_release);
+            }
+            else if (reinterpret_cast<std::atomic<std::uint64_t>*>(&header->magic)->load(std::memory_order_acquire) != Magic || header->element_size != sizeof(T))
+                throw std::invalid_argument("cow::shared_vector: region has another layout");
+        }
+
+        shared_vector(const shared_vector&) = delete;
+        shared_vector& operator=(const shared_vector&) = delete;
+
+        void clear()
+        {
+            std::uint64_t retired;
+            {
+                std::lock_guard<detail::robust_mutex> locker(header()->lock);
+                retired = header()->published;
+                header()->published = 0;
+            }
+
+            release(retired);
+        }
+
+        void push_back(const T& t)
+        {
+            append(&t, 1);
+        }
+
+        // Appends count records with one lock and at most one copy
+        void append(const T* values, std::size_t count)
+        {
+            if (count == 0)
+                return;
+
+            std::uint64_t retired = 0;
+            {
+                std::lock_guard<detail::robust_mutex> locker(header()->lock);
+
+                block* current = block_at(header()->published);
+                std::size_t size = current ? std::size_t(current->size) : 0;
+                if (current && current->holders.load(std::memory_order_acquire) == 1 && current->capacity >= size + count) // nobody holds read-only copy
+                    std::memcpy(data(current) + size, values, count * sizeof(T));
+                else // somebody has a read-only copy or there is no room
+                {
+                    // keeps capacity while records fit so freed storages are reused
+                    std::size_t capacity = current && current->capacity >= size + count ? std::size_t(current->capacity) : TGrowth::capacity(size + count);
+                    std::uint64_t offset = allocate(capacity);
+                    block* storage = block_at(offset);
+                    if (size)
+                        std::memcpy(data(storage), data(current), size * sizeof(T));
+                    std::memcpy(data(storage) + size, values, count * sizeof(T));
+
+                    retired = header()->published;
+                    header()->published = offset;
+                    current = storage;
+                }
+
+                current->size = size + count;
+            }
+
+            release(retired);
+        }
+
+        // Replaces content with count records
+        void assign(const T* values, std::size_t count)
+        {
+            std::uint64_t retired;
+            {
+                std::lock_guard<detail::robust_mutex> locker(header()->lock);
+
+                std::uint64_t offset = 0;
+                if (count)
+                {
+                    offset = allocate(count);
+                    block* storage = block_at(offset);
+                    std::memcpy(data(storage), values, count * sizeof(T));
+                    storage->size = count;
+                }
+
+                retired = header()->published;
+                header()->published = offset;
+            }
+
+            release(retired);
+        }
+
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            std::uint64_t retired = 0;
+            std::size_t count = 0;
+            {
+                std::lock_guard<detail::robust_mutex> locker(header()->lock);
+
+                block* current = block_at(header()->published);
+                if (!current)
+                    return 0;
+
+                T* first = data(current);
+                T* last = first + current->size;
+                T* it = std::find_if(first, last, predicate);
+                if (it == last) // nothing changed
+                    return 0;
+
+                if (current->holders.load(std::memory_order_acquire) == 1) // nobody holds read-only copy
+                {
+                    T* end = std::remove_if(it, last, predicate);
+                    count = std::size_t(last - end);
+                    current->size -= count;
+                }
+                else // somebody has a read-only copy
+                {
+                    std::uint64_t offset = allocate(std::size_t(current->capacity));
+                    block* storage = block_at(offset);
+                    T* out = std::copy(first, it, data(storage));
+                    for (++it, count = 1; it != last; ++it)
+                    {
+                        if (predicate(*it))
+                            ++count;
+                        else
+                            *out++ = *it;
+                    }
+
+                    storage->size = current->size - count;
+                    retired = header()->published;
+                    header()->published = offset;
+                }
+            }
+
+            release(retired);
+            return count;
+        }
+
+        // Read-only copy, it keeps the region mapped, so it may outlive shared_vector
+        class readonly_vector
+        {
+        public:
+            readonly_vector() = delete;
+
+            readonly_vector(const readonly_vector& copy)
+                : _region(copy._region)
+                , _offset(copy._offset)
+            {
+                if (_offset)
+                    block_at(*_region, _offset)->holders.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            readonly_vector& operator=(const readonly_vector& right)
+            {
+                readonly_vector copy(right);
+                std::swap(_region, copy._region);
+                std::swap(_offset, copy._offset);
+                return *this;
+            }
+
+            ~readonly_vector()
+            {
+                release(*_region, _offset);
+            }
+
+            bool empty() const { return size() == 0; }
+            size_type size() const { return _offset ? std::size_t(block_at(*_region, _offset)->size) : 0; }
+
+            const T& at(size_type pos) const
+            {
+                if (pos >= size())
+                    throw std::out_of_range("cow::shared_vector::readonly_vector::at");
+
+                return data()[pos];
+            }
+
+            const T& operator[](size_type pos) const { return data()[pos]; }
+            const T& front() const { return data()[0]; }
+            const T& back() const { return data()[size() - 1]; }
+
+            const T* data() const { return _offset ? shared_vector::data(block_at(*_region, _offset)) : nullptr; }
+
+            const T* begin() const { return data(); }
+            const T* end() const { return data() + size(); }
+
+        private:
+            friend class shared_vector;
+
+            readonly_vector(std::shared_ptr<mapped_region> region, std::uint64_t offset)
+                : _region(std::move(region))
+                , _offset(offset)
+            {
+            }
+
+            std::shared_ptr<mapped_region> _region;
+            std::uint64_t _offset;
+        };
+
+        readonly_vector read_only_copy() const
+        {
+            std::lock_guard<detail::robust_mutex> locker(header()->lock);
+
+            std::uint64_t offset = header()->published;
+            if (offset)
+                block_at(offset)->holders.fetch_add(1, std::memory_order_relaxed);
+
+            return readonly_vector(_region, offset);
+        }
+
+    private:
+        static region_header* header(const mapped_region& region)
+        {
+            return reinterpret_cast<region_header*>(region.base());
+        }
+
+        static block* block_at(const mapped_region& region, std::uint64_t offset)
+        {
+            return offset ? reinterpret_cast<block*>(region.base() + offset) : nullptr;
+        }
+
+        region_header* header() const { return header(*_region); }
+        block* block_at(std::uint64_t offset) const { return block_at(*_region, offset); }
+
+        static T* data(block* storage)
+        {
+            return reinterpret_cast<T*>(reinterpret_cast<char*>(storage) + aligned(sizeof(block)));
+        }
+
+        // This method should be called only under lock.
+        // Takes a freed storage with enough capacity or a new one, it's held by the region.
+        std::uint64_t allocate(std::size_t capacity)
+        {
+            region_header* header = this->header();
+
+            for (std::uint64_t* link = &header->free_list; *link; link = &block_at(*link)->next_free)
+            {
+                block* storage = block_at(*link);
+                if (storage->capacity >= capacity)
+                {
+                    std::uint64_t offset = *link;
+                    *link = storage->next_free;
+                    storage->holders.store(1, std::memory_order_relaxed);
+                    storage->size = 0;
+                    return offset;
+                }
+            }
+
+            std::size_t bytes = aligned(sizeof(block)) + aligned(capacity * sizeof(T));
+            if (bytes > _region->size() - header->top)
+                throw std::bad_alloc();
+
+            std::uint64_t offset = header->top;
+            header->top += bytes;
+
+            block* storage = new (_region->base() + offset) block();
+            storage->holders.store(1, std::memory_order_relaxed);
+            storage->size = 0;
+            storage->capacity = capacity;
+            storage->next_free = 0;
+            return offset;
+        }
+
+        // Drops one holder, the last one returns the storage to the free list. It's called from destructors,
+        // so if the lock fails the storage is leaked like one held by a crashed process.
+        static void release(const mapped_region& region, std::uint64_t offset) noexcept
+        {
+            if (!offset || block_at(region, offset)->holders.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+
+            region_header* header = shared_vector::header(region);
+            if (header->lock.lock_nothrow() != 0)
+                return;
+
+            block_at(region, offset)->next_free = header->free_list;
+            header->free_list = offset;
+            header->lock.unlock();
+        }
+
+        void release(std::uint64_t offset) const noexcept
+        {
+            release(*_region, offset);
+        }
+
+        std::shared_ptr<mapped_region> _region;
+    };
+
+    namespace detail
+    {
+        const std::uint32_t snapshot_file_format = 1;
+
+        // Start of a snapshot file, records follow it
+        struct snapshot_file_header
+        {
+            char magic[8];              // "cowsnap"
+            std::uint32_t format;       // snapshot_file_format
+            std::uint32_t byte_order;   // 0x01020304 in the byte order of the writer
+            std::uint64_t element_size;
+            std::uint64_t count;
+            char reserved[32];          // keeps records aligned to 64 bytes in the mapping
+        };
+
+        static_assert(sizeof(snapshot_file_header) == 64, "records of a snapshot file must be aligned");
+
+        inline const snapshot_file_header& check_snapshot(const mapped_region& region, std::size_t element_size)
+        {
+            const snapshot_file_header* header = reinterpret_cast<const snapshot_file_header*>(region.base());
+            if (region.size() < sizeof(snapshot_file_header) || std::memcmp(header->magic, "cowsnap", 8) != 0)
+                throw std::runtime_error("cow::load_mapped: not a snapshot file");
+
+            if (header->format != snapshot_file_format || header->byte_order != 0x01020304 || header->element_size != element_size)
+                throw std::runtime_error("cow::load_mapped: snapshot file has another layout");
+
+            if ((region.size() - sizeof(snapshot_file_header)) / element_size < header->count)
+                throw std::runtime_error("cow::load_mapped: snapshot file is truncated");
+
+            return *header;
+        }
+    }
+
+    // Writes records of a read-only copy (of vector, shared_vector...) to out as is, after a versioned header.
+    // The file can be loaded only where T has the same layout.
+    template <typename TReadOnly>
+    void save(const TReadOnly& copy, std::ostream& out)
+    {
+        typedef typename std::remove_cv<typename std::remove_pointer<decltype(copy.data())>::type>::type value_type;
+        static_assert(std::is_trivially_copyable<value_type>::value, "only trivially copyable records can be saved");
+
+        detail::snapshot_file_header header = {};
+        std::memcpy(header.magic, "cowsnap", 8);
+        header.format = detail::snapshot_file_format;
+        header.byte_order = 0x01020304;
+        header.element_size = sizeof(value_type);
+        header.count = copy.size();
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        if (!copy.empty())
+            out.write(reinterpret_cast<const char*>(copy.data()), std::streamsize(copy.size() * sizeof(value_type)));
+
+        if (!out)
+            throw std::runtime_error("cow::save: write failed");
+    }
+
+    /**
+     * Read-only records of a snapshot file mapped to memory, they are not copied and pages are read on first access.
+     * Copies share the mapping.
+     */
+    template <typename T>
+    class mapped_snapshot
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable records can be loaded");
+
+    public:
+        typedef T value_type;
+        typedef std::size_t size_type;
+        typedef const T* const_iterator;
+
+        explicit mapped_snapshot(std::shared_ptr<mapped_region> region)
+            : _region(std::move(region))
+            , _size(std::size_t(detail::check_snapshot(*_region, sizeof(T)).count))
+        {
+        }
+
+        bool empty() const { return _size == 0; }
+        size_type size() const { return _size; }
+
+        const T& at(size_type pos) const
+        {
+            if (pos >= _size)
+                throw std::out_of_range("cow::mapped_snapshot::at");
+
+            return data()[pos];
+        }
+
+        const T& operator[](size_type pos) const { return data()[pos]; }
+        const T& front() const { return data()[0]; }
+        const T& back() const { return data()[_size - 1]; }
+
+        const T* data() const { return reinterpret_cast<const T*>(_region->base() + sizeof(detail::snapshot_file_header)); }
+
+        const_iterator begin() const { return data(); }
+        const_iterator end() const { return data() + _size; }
+
+    private:
+        std::shared_ptr<mapped_region> _region;
+        std::size_t _size;
+    };
+
+    // Maps snapshot file path written by save, records are used in place
+    template <typename T>
+    mapped_snapshot<T> load_mapped(const std::string& path)
+    {
+        return mapped_snapshot<T>(mapped_region::open_file(path, true));
+    }
+
+    // Replaces content of vector with records of snapshot file path, they're copied at once from the mapping
+    template <typename TVector>
+    void load(TVector& vector, const std::string& path)
+    {
+        mapped_snapshot<typename TVector::value_type> snapshot = load_mapped<typename TVector::value_type>(path);
+        vector.assign(std::vector<typename TVector::value_type, typename TVector::allocator_type>(snapshot.begin(), snapshot.end()));
+    }
+}
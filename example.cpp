@@ -57,12 +57,15 @@ int main()
 
     auto a2 = v1.find_first([](auto const& a) -> bool { return a->value == 2; }, std::shared_ptr<A>());
 
-    // direct acces should be done only under lock
-    {
-        std::lock_guard<std::mutex> locker(v1.lock());
-        std::vector<std::shared_ptr<A>> & v = v1.data();
+    // several changes in one transaction, data is copied at most once
+    v1.mutate([](std::vector<std::shared_ptr<A>> & v) {
         v[0] = std::make_shared<A>(5);
-    }
+        v.push_back(std::make_shared<A>(6));
+    }); // v1 == { A(5), A(1), A(6) }
+
+    // replace one element, readers of older copies still see the old one
+    v1.update_at(1, [](std::shared_ptr<A>& a) { a = std::make_shared<A>(7); }); // v1 == { A(5), A(7), A(6) }
+    v1.replace_if([](auto const& a) -> bool { return a->value == 6; }, std::make_shared<A>(8)); // v1 == { A(5), A(7), A(8) }
 
     return 0;
 }
@@ -0,0 +1,405 @@
+// Concurrency stress test for snapshot semantics of cow containers.
+// Writers run random push_back, remove, removeFirst and removeLast (insert, remove and erase for maps) while readers
+// iterate and take read-only copies, every observed state is checked against a reference model and every held copy
+// is checked to be stable.
+// Build: g++ -O1 -g -std=c++14 -pthread -fsanitize=thread stress.cpp -o stress
+//        (or -fsanitize=address,undefined)
+// Usage: stress [name filter] [milliseconds per run] [seed]
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "cow.h"
+
+namespace
+{
+    // Element is (writer << 32) | sequence number, each writer pushes and removes only its own elements,
+    // so the elements of one writer in any state of the vector are the state of its model at some moment
+    typedef std::uint64_t value_type;
+
+    template <typename T, typename TLock = std::mutex, typename TReadMode = cow::locked_reads, typename TReclaim = cow::release_after_unlock>
+    using vector_of = cow::vector<T, TLock, std::lock_guard<TLock>, std::allocator<T>, TReadMode, cow::geometric_growth<>, TReclaim>;
+
+#if defined(__cpp_lib_shared_mutex)
+    typedef std::shared_mutex shared_mutex;
+#else
+    typedef std::shared_timed_mutex shared_mutex;
+#endif
+
+    typedef std::chrono::steady_clock clock;
+
+    const char* filter = "";
+    std::chrono::milliseconds duration(200);
+    unsigned seed = 1;
+    int failures = 0;
+
+    bool enabled(const std::string& name)
+    {
+        return name.find(filter) != std::string::npos;
+    }
+
+    // Vector whose push_back goes through combining_writer, other writes go to the vector directly
+    template <typename TVector>
+    class combined : public TVector
+    {
+    public:
+        combined()
+            : _writer(*this)
+        {
+        }
+
+        cow::write_result push_back(const value_type& t)
+        {
+            return _writer.push_back(t);
+        }
+
+    private:
+        cow::combining_writer<TVector> _writer;
+    };
+
+    // Map from element to itself, removeFirst and removeLast erase the key the writer chose from its model
+    template <typename TMap>
+    class keyed : public TMap
+    {
+    public:
+        void push_back(const value_type& t)
+        {
+            this->insert(t, t);
+        }
+
+        template <typename _Pred>
+        std::size_t remove(_Pred predicate)
+        {
+            return TMap::remove([&predicate](const typename TMap::value_type& elem) { return predicate(elem.first); });
+        }
+    };
+
+    template <typename V, typename _Pred>
+    bool remove_one(V& v, _Pred predicate, value_type, bool first)
+    {
+        return first ? v.removeFirst(predicate) : v.removeLast(predicate);
+    }
+
+    template <typename TMap, typename _Pred>
+    bool remove_one(keyed<TMap>& v, _Pred, value_type key, bool)
+    {
+        return v.erase(key);
+    }
+
+    // Order of elements is checked only for vectors
+    template <typename V>
+    struct ordered : std::true_type {};
+
+    template <typename TMap>
+    struct ordered<keyed<TMap>> : std::false_type {};
+
+    value_type element(value_type value)
+    {
+        return value;
+    }
+
+    value_type element(const std::pair<const value_type, value_type>& elem)
+    {
+        return elem.first == elem.second ? elem.first : ~value_type(0); // a torn pair is an unknown element
+    }
+
+    const std::uint64_t hash_basis = 14695981039346656037ull;
+
+    std::uint64_t hash_step(std::uint64_t hash, value_type value, std::true_type)
+    {
+        return (hash ^ value) * 1099511628211ull;
+    }
+
+    std::uint64_t hash_step(std::uint64_t hash, value_type value, std::false_type) // doesn't depend on order
+    {
+        value = (value ^ (value >> 31)) * 0x9E3779B97F4A7C15ull;
+        return hash + (value ^ (value >> 29));
+    }
+
+    unsigned owner(value_type value)
+    {
+        return unsigned(value >> 32);
+    }
+
+    // Progress of one writer, hashes of its model are kept for the last History states
+    struct writer_progress
+    {
+        static const std::size_t History = 65536;
+
+        writer_progress()
+        {
+            hashes[0].store(hash_basis);
+        }
+
+        std::atomic<std::uint64_t> started{ 0 };
+        std::atomic<std::uint64_t> completed{ 0 };
+        std::atomic<std::uint64_t> hashes[History];
+    };
+
+    struct run_state
+    {
+        explicit run_state(int writers)
+            : progress(writers)
+        {
+        }
+
+        std::vector<writer_progress> progress;
+        std::atomic<bool> stop{ false };
+        std::atomic<long> writes{ 0 };
+        std::atomic<long> reads{ 0 };
+        std::atomic<long> checks{ 0 };
+        std::atomic<long> skipped{ 0 };
+        std::atomic<bool> failed{ false };
+    };
+
+    void fail(run_state& state, const std::string& name, const char* what, unsigned writer, std::uint64_t detail)
+    {
+        if (!state.failed.exchange(true))
+            std::printf("FAILED %s: %s (writer %u, %llu)\n", name.c_str(), what, writer, (unsigned long long)detail);
+        state.stop = true;
+    }
+
+    template <typename V>
+    void write(V& v, run_state& state, const std::string& name, unsigned writer)
+    {
+        std::mt19937_64 random(seed * 7919u + writer);
+        std::vector<value_type> model;
+        std::uint64_t sequence = 0;
+        writer_progress& progress = state.progress[writer];
+
+        long ops = 0;
+        for (std::uint64_t k = 0; !state.stop; ++k, ++ops)
+        {
+            // the size of the model stays around 32, so removals find something
+            unsigned op = unsigned(random() % 8);
+            if (model.size() < 8)
+                op = 0;
+            else if (model.size() > 64)
+                op = 4 + op % 4;
+
+            value_type mod = 2 + random() % 3, residue = random() % mod;
+            auto predicate = [writer, mod, residue](value_type value) { return owner(value) == writer && value % mod == residue; };
+            auto matching = [&](value_type value) { return value % mod == residue; };
+
+            // the model is changed first, so the state is known to readers before the write starts
+            value_type value = (value_type(writer) << 32) | sequence;
+            value_type removed = (value_type(writer) << 32) | 0xffffffffu; // never pushed
+            std::size_t expected = 0;
+            if (op < 4)
+            {
+                model.push_back(value);
+                ++sequence;
+            }
+            else if (op < 6)
+            {
+                std::size_t size = model.size();
+                model.erase(std::remove_if(model.begin(), model.end(), matching), model.end());
+                expected = size - model.size();
+            }
+            else if (op == 6)
+            {
+                auto it = std::find_if(model.begin(), model.end(), matching);
+                if (it != model.end())
+                {
+                    removed = *it;
+                    model.erase(it);
+                    expected = 1;
+                }
+            }
+            else
+            {
+                auto it = std::find_if(model.rbegin(), model.rend(), matching);
+                if (it != model.rend())
+                {
+                    removed = *it;
+                    model.erase(std::next(it).base());
+                    expected = 1;
+                }
+            }
+
+            std::uint64_t hash = hash_basis;
+            for (value_type elem : model)
+                hash = hash_step(hash, elem, ordered<V>());
+
+            progress.hashes[(k + 1) % writer_progress::History].store(hash, std::memory_order_relaxed);
+            progress.started.store(k + 1, std::memory_order_release);
+
+            if (op < 4)
+                v.push_back(value);
+            else if (op < 6)
+            {
+                std::size_t count = v.remove(predicate);
+                if (count != expected)
+                    fail(state, name, "remove count", writer, count);
+            }
+            else if (remove_one(v, predicate, removed, op == 6) != (expected == 1))
+                fail(state, name, op == 6 ? "removeFirst result" : "removeLast result", writer, k);
+
+            progress.completed.store(k + 1, std::memory_order_release);
+        }
+
+        state.writes += ops;
+    }
+
+    // Checks that the elements of each writer in the range are a state of its model between
+    // the last write completed before the range was taken and the last one started after that
+    template <typename V, typename _It>
+    void check(run_state& state, const std::string& name, const std::vector<std::uint64_t>& first, _It begin, _It end)
+    {
+        std::vector<std::uint64_t> last(state.progress.size());
+        for (std::size_t w = 0; w < last.size(); ++w)
+            last[w] = state.progress[w].started.load(std::memory_order_acquire);
+
+        std::vector<std::uint64_t> hashes(state.progress.size(), hash_basis);
+        for (_It it = begin; it != end; ++it)
+        {
+            value_type value = element(*it);
+            if (owner(value) >= hashes.size())
+                return fail(state, name, "unknown element", owner(value), value);
+
+            hashes[owner(value)] = hash_step(hashes[owner(value)], value, ordered<V>());
+        }
+
+        for (std::size_t w = 0; w < hashes.size(); ++w)
+        {
+            writer_progress& progress = state.progress[w];
+
+            bool found = false;
+            for (std::uint64_t k = first[w]; k <= last[w] && !found; ++k)
+                found = progress.hashes[k % writer_progress::History].load(std::memory_order_relaxed) == hashes[w];
+
+            // the writer went on too far and overwrote hashes of the range
+            if (progress.started.load(std::memory_order_acquire) - first[w] >= writer_progress::History)
+                ++state.skipped;
+            else if (!found)
+                return fail(state, name, "state isn't linearizable", unsigned(w), first[w]);
+            else
+                ++state.checks;
+        }
+    }
+
+    template <typename V, typename TCopy>
+    std::uint64_t hash_of(const TCopy& copy)
+    {
+        std::uint64_t hash = hash_basis;
+        for (const auto& elem : copy)
+            hash = hash_step(hash, element(elem), ordered<V>());
+
+        return hash;
+    }
+
+    template <typename V>
+    void read(V& v, run_state& state, const std::string& name)
+    {
+        std::vector<std::uint64_t> first(state.progress.size());
+        auto started = [&] {
+            for (std::size_t w = 0; w < first.size(); ++w)
+                first[w] = state.progress[w].completed.load(std::memory_order_acquire);
+        };
+
+        auto held = v.read_only_copy(); // it's compared with itself after other reads
+        std::uint64_t held_hash = hash_of<V>(held);
+
+        long ops = 0;
+        for (; !state.stop; ++ops)
+        {
+            started();
+            if (ops % 2)
+            {
+                auto copy = v.read_only_copy();
+                check<V>(state, name, first, copy.begin(), copy.end());
+            }
+            else
+                check<V>(state, name, first, v.begin(), v.end());
+
+            if (ops % 16 == 15)
+            {
+                if (hash_of<V>(held) != held_hash)
+                    fail(state, name, "read-only copy changed", 0, held.size());
+
+                held = v.read_only_copy();
+                held_hash = hash_of<V>(held);
+            }
+        }
+
+        state.reads += ops;
+    }
+
+    template <typename V>
+    void stress(const std::string& backend, int writers, int readers)
+    {
+        std::string name = backend + "/" + std::to_string(writers) + "w" + std::to_string(readers) + "r";
+        if (!enabled(name))
+            return;
+
+        V v;
+        run_state state(writers);
+        std::vector<std::thread> threads;
+
+        clock::time_point start = clock::now();
+        for (int i = 0; i < writers; ++i)
+            threads.emplace_back([&, i] { write(v, state, name, unsigned(i)); });
+        for (int i = 0; i < readers; ++i)
+            threads.emplace_back([&] { read(v, state, name); });
+
+        std::this_thread::sleep_for(duration);
+        state.stop = true;
+        for (auto& thread : threads)
+            thread.join();
+
+        // the final state is the one of the models
+        state.stop = false;
+        std::vector<std::uint64_t> first(writers);
+        for (int w = 0; w < writers; ++w)
+            first[w] = state.progress[w].completed;
+        auto copy = v.read_only_copy();
+        check<V>(state, name, first, copy.begin(), copy.end());
+
+        double seconds = std::chrono::duration<double>(clock::now() - start).count();
+        std::printf("%-48s %12.0f writes/s %12.0f reads/s %10ld checks %6ld skipped %s\n", name.c_str(),
+            double(state.writes) / seconds, double(state.reads) / seconds, long(state.checks), long(state.skipped), state.failed ? "FAILED" : "ok");
+
+        if (state.failed)
+            ++failures;
+    }
+
+    template <typename V>
+    void stress_all(const std::string& backend)
+    {
+        stress<V>(backend, 1, 1);
+        stress<V>(backend, 4, 4);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+    if (argc > 2)
+        duration = std::chrono::milliseconds(std::atoi(argv[2]));
+    if (argc > 3)
+        seed = unsigned(std::atoi(argv[3]));
+
+    stress_all<vector_of<value_type, std::mutex>>("vector/mutex");
+    stress_all<vector_of<value_type, cow::spin_lock>>("vector/spin_lock");
+    stress_all<vector_of<value_type, shared_mutex>>("vector/shared_mutex");
+    stress_all<vector_of<value_type, std::mutex, cow::atomic_reads>>("vector/mutex+atomic_reads");
+    stress_all<vector_of<value_type, cow::spin_lock, cow::atomic_reads>>("vector/spin_lock+atomic_reads");
+    stress_all<vector_of<value_type, std::mutex, cow::replicated_reads<2>>>("vector/mutex+replicated_reads");
+    stress_all<vector_of<value_type, std::mutex, cow::locked_reads, cow::background_reclaim>>("vector/mutex+background_reclaim");
+    stress_all<combined<vector_of<value_type, std::mutex>>>("combining/mutex");
+    stress_all<cow::persistent_vector<value_type>>("persistent/mutex");
+    stress_all<cow::persistent_vector<value_type, std::mutex, std::lock_guard<std::mutex>, cow::atomic_reads>>("persistent/mutex+atomic_reads");
+    stress_all<keyed<cow::unordered_map<value_type, value_type>>>("unordered_map/mutex");
+    stress_all<keyed<cow::unordered_map<value_type, value_type, std::hash<value_type>, std::equal_to<value_type>, std::mutex, std::lock_guard<std::mutex>, cow::atomic_reads>>>("unordered_map/mutex+atomic_reads");
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,1047 @@
+// Behavior tests of cow containers, including their error paths.
+// Build: g++ -g -std=c++14 -pthread -fsanitize=address,undefined test.cpp -o test (add -lrt for shm_open on old glibc)
+// Usage: test [name filter]
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "cow.h"
+
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include "cow_mapped.h"
+#endif
+
+namespace
+{
+    const char* filter = "";
+    int failures = 0;
+
+    // Failed checks are reported and the test goes on, so one run shows all of them
+    bool check(bool condition, const char* what, int line)
+    {
+        if (!condition)
+        {
+            std::printf("  line %d: %s\n", line, what);
+            ++failures;
+        }
+
+        return condition;
+    }
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+#define CHECK_THROWS(expression, exception) \
+    do { bool thrown = false; try { expression; } catch (const exception&) { thrown = true; } check(thrown, #expression " throws " #exception, __LINE__); } while (false)
+
+    template <typename _Func>
+    void run(const char* name, _Func test)
+    {
+        if (!std::strstr(name, filter))
+            return;
+
+        int before = failures;
+        try
+        {
+            test();
+        }
+        catch (const std::exception& e)
+        {
+            std::printf("  unexpected exception: %s\n", e.what());
+            ++failures;
+        }
+
+        std::printf("%-32s %s\n", name, failures == before ? "ok" : "FAILED");
+    }
+
+    template <typename TCopy, typename T = typename std::decay<decltype(*std::declval<const TCopy&>().begin())>::type>
+    std::vector<T> elements(const TCopy& copy)
+    {
+        return std::vector<T>(copy.begin(), copy.end());
+    }
+
+    // Compare which throws once armed, to check that a failed write changes nothing
+    struct throwing_less
+    {
+        bool operator()(int left, int right) const
+        {
+            if (*armed)
+                throw std::runtime_error("compare failed");
+
+            return left < right;
+        }
+
+        std::shared_ptr<bool> armed = std::make_shared<bool>(false);
+    };
+
+    void test_sorted_vector()
+    {
+        cow::sorted_vector<int> v;
+        CHECK(v.insert(5));
+        CHECK(v.insert(1));
+        CHECK(v.insert(3));
+        CHECK(!v.insert(3)); // duplicate
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 1, 3, 5 }));
+
+        CHECK(v.insert_many(std::vector<int>{ 4, 2, 4, 5, 0 }) == 3);
+        CHECK(v.insert_many(std::vector<int>{ 1, 2 }) == 0);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 0, 1, 2, 3, 4, 5 }));
+
+        auto copy = v.read_only_copy();
+        std::size_t version = v.version();
+        CHECK(v.erase(2));
+        CHECK(!v.erase(2));
+        CHECK(!v.erase(42));
+        CHECK(v.version() != version);
+        CHECK(copy.size() == 6 && copy.contains(2)); // the copy doesn't change
+
+        CHECK(v.contains(3) && !v.contains(2));
+        CHECK(v.find(4, -1) == 4 && v.find(2, -1) == -1);
+        CHECK(*copy.lower_bound(2) == 2 && *copy.upper_bound(2) == 3);
+        CHECK(copy.find(6) == copy.end() && copy.lower_bound(6) == copy.end());
+
+        CHECK(v.remove([](int x) { return x % 2 == 0; }) == 2);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 1, 3, 5 }));
+
+        v.clear();
+        CHECK(v.read_only_copy().empty() && !v.contains(1));
+
+        cow::sorted_vector<int, std::greater<int>> descending;
+        descending.insert_many(std::vector<int>{ 1, 3, 2 });
+        CHECK(elements(descending.read_only_copy()) == std::vector<int>({ 3, 2, 1 }));
+        CHECK(*descending.read_only_copy().lower_bound(2) == 2);
+
+        // a write which throws leaves the content as it was
+        throwing_less compare;
+        cow::sorted_vector<int, throwing_less> failing(compare);
+        failing.insert_many(std::vector<int>{ 1, 2, 3 });
+        *compare.armed = true;
+        CHECK_THROWS(failing.insert_many(std::vector<int>{ 4, 0 }), std::runtime_error);
+        CHECK_THROWS(failing.insert(7), std::runtime_error);
+        *compare.armed = false;
+        CHECK(elements(failing.read_only_copy()) == std::vector<int>({ 1, 2, 3 }));
+    }
+
+    // Hash which puts every key into one probe sequence
+    struct colliding_hash
+    {
+        std::size_t operator()(int) const { return 42; }
+    };
+
+    // Checks that the map has exactly keys first, first + step... below last, each mapped to its string
+    template <typename TMap>
+    void check_map(const TMap& map, int first, int last, int step)
+    {
+        auto copy = map.read_only_copy();
+        std::size_t found = 0;
+        for (int key = first; key < last; key += step)
+        {
+            if (!CHECK(copy.contains(key) && copy.at(key) == std::to_string(key)))
+                return;
+            ++found;
+        }
+
+        CHECK(copy.size() == found);
+    }
+
+    void test_unordered_map()
+    {
+        cow::unordered_map<int, std::string> map;
+        CHECK(map.read_only_copy().empty() && !map.contains(1) && map.find(1, "none") == "none");
+        CHECK(!map.erase(1) && map.remove([](const std::pair<const int, std::string>&) { return true; }) == 0);
+
+        CHECK(map.insert(1, "one"));
+        CHECK(!map.insert(1, "uno")); // key is there, the value stays
+        CHECK(map.find(1, "none") == "one");
+        CHECK(!map.insert_or_assign(1, "uno") && map.find(1, "none") == "uno");
+        CHECK(map.insert_or_assign(2, "two"));
+
+        auto copy = map.read_only_copy();
+        for (int key = 3; key < 1000; ++key) // grows the table while the copy shares its groups
+            map.insert(key, std::to_string(key));
+        map.insert_or_assign(2, "2");
+        map.insert_or_assign(1, "1");
+        CHECK(copy.size() == 2 && copy.at(1) == "uno" && copy.at(2) == "two" && !copy.contains(3));
+        check_map(map, 1, 1000, 1);
+
+        CHECK(map.remove([](const std::pair<const int, std::string>& pair) { return pair.first < 3 || pair.first % 2 != 0; }) == 501);
+        check_map(map, 4, 1000, 2);
+        CHECK(map.erase(4) && !map.erase(4) && !map.contains(4));
+        CHECK_THROWS(map.read_only_copy().at(4), std::out_of_range);
+
+        cow::unordered_map<int, std::string> assigned;
+        assigned = map;
+        cow::unordered_map<int, std::string> copied(map);
+        map.clear();
+        CHECK(map.read_only_copy().empty() && map.read_only_copy().begin() == map.read_only_copy().end());
+        CHECK(assigned.read_only_copy().size() == 497 && copied.read_only_copy().size() == 497 && copied.contains(998) && !copied.contains(4));
+
+        // erase in the middle of a probe sequence keeps the keys after it reachable
+        cow::unordered_map<int, std::string, colliding_hash> colliding;
+        for (int key = 0; key < 40; ++key)
+            colliding.insert(key, std::to_string(key));
+        auto before = colliding.read_only_copy();
+        for (int key = 0; key < 40; key += 3)
+            CHECK(colliding.erase(key));
+        CHECK(before.size() == 40 && before.contains(0));
+        for (int key = 0; key < 40; ++key)
+            if (!CHECK(colliding.contains(key) == (key % 3 != 0)))
+                break;
+
+        cow::unordered_map<int, std::string, std::hash<int>, std::equal_to<int>, cow::spin_lock, std::lock_guard<cow::spin_lock>, cow::atomic_reads> atomic;
+        for (int key = 0; key < 100; key += 2)
+            atomic.insert(key, std::to_string(key));
+        auto pinned = atomic.read_only_copy();
+        atomic.remove([](const std::pair<const int, std::string>& pair) { return pair.first < 50; });
+        check_map(atomic, 50, 100, 2);
+        CHECK(pinned.size() == 50);
+    }
+
+    void test_async_writer()
+    {
+        typedef cow::vector<int> vector_type;
+        vector_type v;
+        {
+            cow::async_writer<vector_type> writer(v, std::chrono::seconds(10), 4); // only flush() and max_batch wake it
+            for (int i = 0; i < 3; ++i)
+                writer.push_back(i);
+            writer.remove([](int x) { return x == 1; });
+            writer.flush();
+            CHECK(elements(v.read_only_copy()) == std::vector<int>({ 0, 2 }));
+
+            // max_batch queued writes are applied without waiting for the interval
+            std::vector<std::future<cow::write_result>> results;
+            for (int i = 0; i < 4; ++i)
+                results.push_back(writer.submit([i](std::vector<int>& storage) { storage.push_back(10 + i); }));
+            for (auto& result : results)
+                CHECK(result.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+            CHECK(elements(v.read_only_copy()) == std::vector<int>({ 0, 2, 10, 11, 12, 13 }));
+
+            // a write held by a read-only copy is applied on a copy
+            auto copy = v.read_only_copy();
+            std::future<cow::write_result> copied = writer.submit([](std::vector<int>& storage) { storage.pop_back(); });
+            writer.flush();
+            CHECK(copied.get() == cow::write_result::copied && copy.size() == 6 && v.read_only_copy().size() == 5);
+
+            // an exception of one write goes to its future and the other writes of the batch are applied
+            writer.apply([](std::vector<int>&) { throw std::runtime_error("ignored"); });
+            std::future<cow::write_result> failed = writer.submit([](std::vector<int>&) { throw std::logic_error("write failed"); });
+            writer.push_back(20);
+            writer.flush();
+            CHECK_THROWS(failed.get(), std::logic_error);
+            CHECK(v.read_only_copy().back() == 20);
+
+            writer.push_back(30); // applied on destruction
+        }
+        CHECK(v.read_only_copy().size() == 7 && v.read_only_copy().back() == 30);
+
+        // writes of several threads are all applied, in order within each thread
+        {
+            cow::async_writer<vector_type> writer(v, std::chrono::microseconds(100), 16);
+            v.clear();
+            std::vector<std::thread> threads;
+            for (int t = 0; t < 4; ++t)
+                threads.emplace_back([&writer, t] {
+                    for (int i = 0; i < 1000; ++i)
+                        writer.push_back(t * 1000 + i);
+                });
+            for (auto& thread : threads)
+                thread.join();
+            writer.flush();
+        }
+
+        std::vector<int> last(4, -1);
+        auto copy = v.read_only_copy();
+        bool ordered = copy.size() == 4000;
+        for (int x : copy)
+        {
+            ordered = ordered && x % 1000 == last[x / 1000] + 1;
+            last[x / 1000] = x % 1000;
+        }
+        CHECK(ordered);
+    }
+
+    // Element whose copy throws after copies_left more copies, never if it's negative
+    struct throwing_copy
+    {
+        static int copies_left;
+
+        explicit throwing_copy(int v) : value(v) {}
+
+        throwing_copy(const throwing_copy& copy)
+            : value(copy.value)
+        {
+            if (copies_left == 0)
+                throw std::runtime_error("copy failed");
+            if (copies_left > 0)
+                --copies_left;
+        }
+
+        throwing_copy& operator=(const throwing_copy&) = default;
+
+        int value;
+    };
+
+    int throwing_copy::copies_left = -1;
+
+    void test_small_vector()
+    {
+        typedef cow::small_vector<std::string, 2, cow::spin_lock, std::lock_guard<cow::spin_lock>, cow::fixed_growth<4>> small_type;
+        small_type v;
+        CHECK(v.empty() && v.read_only_copy().empty());
+
+        v.push_back("a");
+        v.push_back("b");
+        auto inline_copy = v.read_only_copy();
+        const std::string* inline_data = inline_copy.data();
+        v.push_back("c"); // goes to the heap
+        CHECK(inline_copy.size() == 2 && inline_copy.data() == inline_data && inline_copy.back() == "b");
+        CHECK_THROWS(inline_copy.at(2), std::out_of_range);
+
+        // unshared heap storage with room left is written in place
+        const std::string* heap_data = v.read_only_copy().data();
+        v.push_back("d");
+        v.push_back("e");
+        CHECK(v.read_only_copy().data() == heap_data && elements(v.read_only_copy()) == std::vector<std::string>({ "a", "b", "c", "d", "e" }));
+        CHECK(v.remove([](const std::string& x) { return x == "d"; }) == 1 && v.read_only_copy().data() == heap_data);
+
+        // a write while a copy holds the heap storage is made on a copy
+        auto heap_copy = v.read_only_copy();
+        v.push_back("f");
+        CHECK(v.removeFirst([](const std::string& x) { return x == "a"; }));
+        CHECK(v.removeLast([](const std::string& x) { return x.size() == 1; }));
+        CHECK(!v.removeFirst([](const std::string& x) { return x == "a"; }));
+        CHECK(elements(heap_copy) == std::vector<std::string>({ "a", "b", "c", "e" }));
+        CHECK(elements(v.read_only_copy()) == std::vector<std::string>({ "b", "c", "e" }));
+
+        CHECK(v.exists([](const std::string& x) { return x == "c"; }) && v.find_first([](const std::string& x) { return x > "b"; }, "none") == "c");
+        CHECK(v.count_if([](const std::string& x) { return x != "e"; }) == 2 && v.size() == 3);
+
+        // a list which shrinks to N elements goes back inline
+        CHECK(v.remove([](const std::string& x) { return x == "b"; }) == 1);
+        CHECK(v.read_only_copy().data() != v.read_only_copy().data()); // inline copies have their own elements
+        CHECK(elements(v.read_only_copy()) == std::vector<std::string>({ "c", "e" }));
+
+        v.clear();
+        CHECK(v.empty() && heap_copy.size() == 4);
+
+        // a write whose copy throws leaves the content as it was
+        cow::small_vector<throwing_copy, 2> failing;
+        for (int i = 0; i < 4; ++i)
+            failing.push_back(throwing_copy(i));
+        auto pinned = failing.read_only_copy();
+        throwing_copy::copies_left = 0;
+        CHECK_THROWS(failing.push_back(throwing_copy(4)), std::runtime_error);
+        CHECK_THROWS(failing.remove([](const throwing_copy& x) { return x.value == 0; }), std::runtime_error);
+        throwing_copy::copies_left = -1;
+        CHECK(failing.size() == 4 && failing.count_if([](const throwing_copy& x) { return x.value < 4; }) == 4 && pinned.size() == 4);
+
+        // a list going back inline keeps its elements if a copy throws, it stays on the heap
+        cow::small_vector<throwing_copy, 4> shrinking;
+        for (int i = 0; i < 7; ++i)
+            shrinking.push_back(throwing_copy(i));
+        CHECK(shrinking.remove([](const throwing_copy& x) { return x.value >= 5; }) == 2);
+        throwing_copy::copies_left = 1;
+        CHECK(shrinking.remove([](const throwing_copy& x) { return x.value == 0; }) == 1);
+        throwing_copy::copies_left = 1;
+        CHECK(shrinking.removeFirst([](const throwing_copy& x) { return x.value == 1; }));
+        throwing_copy::copies_left = -1;
+        CHECK(shrinking.size() == 3 && shrinking.count_if([](const throwing_copy& x) { return x.value >= 2 && x.value <= 4; }) == 3);
+        shrinking.push_back(throwing_copy(5));
+        CHECK(shrinking.read_only_copy().back().value == 5 && shrinking.size() == 4);
+    }
+
+    // Applies changes to a cache of the older copy as a consumer of tracked_vector does: inserted elements
+    // are placeholders until all changes are applied, then their indexes match the newer copy
+    template <typename TCopy>
+    std::vector<int> updated(const std::vector<int>& cache, const std::vector<cow::change>& changes, const TCopy& newer)
+    {
+        std::vector<std::pair<int, bool>> result; // element and whether it's inserted
+        for (int x : cache)
+            result.emplace_back(x, false);
+
+        for (const cow::change& c : changes)
+        {
+            auto pos = result.begin() + std::ptrdiff_t(c.pos);
+            if (c.kind == cow::change_kind::reset)
+                result.assign(newer.size(), std::make_pair(0, true));
+            else if (c.kind == cow::change_kind::inserted)
+                result.insert(pos, c.count, std::make_pair(0, true));
+            else
+                result.erase(pos, pos + std::ptrdiff_t(c.count));
+        }
+
+        std::vector<int> elements;
+        for (std::size_t i = 0; i < result.size(); ++i)
+            elements.push_back(result[i].second && i < newer.size() ? newer[i] : result[i].first);
+        return elements;
+    }
+
+    void test_tracked_vector()
+    {
+        cow::tracked_vector<cow::vector<int>> v;
+        auto empty = v.read_only_copy();
+        for (int i = 0; i < 10; ++i)
+            v.push_back(i);
+        auto older = v.read_only_copy();
+        CHECK(v.diff(older, older).empty());
+        CHECK(updated({}, v.diff(empty, older), older) == elements(older));
+
+        std::vector<int> more = { 100, 101 };
+        v.push_front(-1);
+        v.insert(5, more.begin(), more.end());
+        v.remove([](int x) { return x == 3 || x == 4 || x == 8; });
+        v.push_back(10);
+        auto newer = v.read_only_copy();
+        std::vector<cow::change> changes = v.diff(older, newer);
+        CHECK(changes.size() == 6); // the removal of adjacent 3 and 4 is one change
+        CHECK(updated(elements(older), changes, newer) == elements(newer));
+        CHECK(elements(older).size() == 10); // copies don't change
+
+        // errors change neither the vector nor the log
+        CHECK_THROWS(v.diff(newer, older), std::invalid_argument);
+        CHECK_THROWS(v.insert(100, more.begin(), more.end()), std::out_of_range);
+        CHECK_THROWS(v.remove([](int x) -> bool { if (x == 100) throw std::runtime_error("predicate failed"); return false; }), std::runtime_error);
+        auto after_errors = v.read_only_copy();
+        CHECK(v.diff(newer, after_errors).empty() && elements(after_errors) == elements(newer));
+        std::size_t version = v.version();
+        CHECK(v.remove([](int x) { return x > 1000; }) == 0);
+        CHECK(v.version() == version); // a removal of nothing isn't published
+
+        v.mutate([](std::vector<int>& storage) { storage.resize(3); });
+        auto mutated = v.read_only_copy();
+        changes = v.diff(newer, mutated);
+        CHECK(changes.size() == 1 && changes[0].kind == cow::change_kind::reset && changes[0].count == 3);
+        v.clear();
+        CHECK(updated(elements(mutated), v.diff(mutated, v.read_only_copy()), v.read_only_copy()).empty());
+
+        // a diff over changes the log has forgotten is a reset
+        cow::tracked_vector<cow::vector<int>, 4> short_log;
+        auto start = short_log.read_only_copy();
+        for (int i = 0; i < 10; ++i)
+            short_log.push_back(i);
+        auto last = short_log.read_only_copy();
+        changes = short_log.diff(start, last);
+        CHECK(changes.size() == 1 && changes[0].kind == cow::change_kind::reset);
+        CHECK(updated({}, changes, last) == elements(last));
+    }
+
+    // Allocator tagged with the NUMA node it would allocate on, it records the node of every allocation
+    template <typename T>
+    struct node_allocator
+    {
+        typedef T value_type;
+
+        node_allocator() = default;
+
+        explicit node_allocator(int n)
+            : node(n)
+        {
+        }
+
+        template <typename U>
+        node_allocator(const node_allocator<U>& copy)
+            : node(copy.node)
+        {
+        }
+
+        T* allocate(std::size_t n)
+        {
+            T* p = static_cast<T*>(::operator new(n * sizeof(T)));
+            nodes()[p] = node;
+            return p;
+        }
+
+        void deallocate(T* p, std::size_t)
+        {
+            nodes().erase(p);
+            ::operator delete(p);
+        }
+
+        static std::map<const void*, int>& nodes()
+        {
+            static std::map<const void*, int> allocations;
+            return allocations;
+        }
+
+        bool operator==(const node_allocator& right) const { return node == right.node; }
+        bool operator!=(const node_allocator& right) const { return node != right.node; }
+
+        int node = -1; // the writer's node
+    };
+}
+
+namespace cow
+{
+    template <typename T>
+    struct read_group_allocator<node_allocator<T>>
+    {
+        static node_allocator<T> get(const node_allocator<T>&, unsigned group)
+        {
+            return node_allocator<T>(int(group));
+        }
+    };
+}
+
+namespace
+{
+    void test_replicated_reads()
+    {
+        typedef cow::vector<int, std::mutex, std::lock_guard<std::mutex>, node_allocator<int>, cow::replicated_reads<2>> vector_type;
+        unsigned group = cow::read_group();
+
+        vector_type v;
+        for (int i = 0; i < 100; ++i)
+            v.push_back(i);
+
+        // every group reads a replica made by its allocator
+        cow::set_read_group(0);
+        auto first = v.read_only_copy();
+        cow::set_read_group(1);
+        auto second = v.read_only_copy();
+        CHECK(elements(first) == elements(second) && first.size() == 100);
+        CHECK(first.data() != second.data());
+        CHECK(node_allocator<int>::nodes()[first.data()] == 0 && node_allocator<int>::nodes()[second.data()] == 1);
+
+        std::vector<int> replaced(10, 7);
+        v.mutate([](std::vector<int, node_allocator<int>>& storage) { storage[0] = -1; });
+        v.assign(std::vector<int, node_allocator<int>>(replaced.begin(), replaced.end()));
+        cow::set_read_group(0);
+        CHECK(elements(v.read_only_copy()) == replaced && node_allocator<int>::nodes()[v.read_only_copy().data()] == 0);
+        CHECK(first.size() == 100 && first[0] == 0 && second[0] == 0); // copies don't change
+
+        v.clear();
+        CHECK(v.read_only_copy().empty());
+        cow::set_read_group(group);
+    }
+
+    cow::vector<int> numbers(int count)
+    {
+        cow::vector<int> v;
+        for (int i = 0; i < count; ++i)
+            v.push_back(i);
+        return v;
+    }
+
+    void test_remove_indices()
+    {
+        // in place: nobody holds a copy
+        cow::vector<int> v = numbers(10);
+        CHECK(v.remove_indices(std::vector<std::size_t>{ 0, 3, 4, 9 }) == 4);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 1, 2, 5, 6, 7, 8 }));
+        CHECK(v.remove_indices(std::vector<std::size_t>{}) == 0);
+
+        // on a copy: the copy keeps everything
+        auto copy = v.read_only_copy();
+        CHECK(v.remove_indices(std::vector<std::size_t>{ 1, 2 }) == 2);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 1, 6, 7, 8 }));
+        CHECK(elements(copy) == std::vector<int>({ 1, 2, 5, 6, 7, 8 }));
+
+        // errors change nothing
+        CHECK_THROWS(v.remove_indices(std::vector<std::size_t>{ 2, 1 }), std::invalid_argument);
+        CHECK_THROWS(v.remove_indices(std::vector<std::size_t>{ 1, 1 }), std::invalid_argument);
+        CHECK_THROWS(v.remove_indices(std::vector<std::size_t>{ 0, 4 }), std::out_of_range);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 1, 6, 7, 8 }));
+
+        CHECK(v.remove_indices(std::vector<std::size_t>{ 0, 1, 2, 3 }) == 4);
+        CHECK(v.read_only_copy().empty());
+    }
+
+    void test_remove_if_sorted()
+    {
+        auto below = [](int limit) { return [limit](int x) { return x < limit; }; };
+
+        cow::vector<int> v = numbers(10);
+        CHECK(v.remove_if_sorted(below(0)) == 0);
+        CHECK(v.remove_if_sorted(below(3)) == 3); // in place
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 3, 4, 5, 6, 7, 8, 9 }));
+
+        auto copy = v.read_only_copy();
+        CHECK(v.remove_if_sorted(below(5)) == 2); // on a copy
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 5, 6, 7, 8, 9 }));
+        CHECK(copy.size() == 7 && copy[0] == 3);
+
+        CHECK(v.remove_if_sorted(below(100)) == 5);
+        CHECK(v.read_only_copy().empty() && copy.size() == 7);
+        CHECK(v.remove_if_sorted(below(100)) == 0);
+    }
+
+    void test_wait_for_change()
+    {
+        cow::vector<int> v;
+        std::size_t version = v.version();
+        CHECK(v.wait_for_change(version, std::chrono::milliseconds(10)) == version); // timed out
+        v.push_back(1);
+        CHECK(v.wait_for_change(version) == v.version() && v.version() != version); // changed already
+
+        version = v.version();
+        std::thread writer([&v] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            v.push_back(2);
+        });
+        std::size_t woken = v.wait_for_change(version);
+        writer.join();
+        CHECK(woken != version && woken == v.version());
+
+        version = v.version();
+        writer = std::thread([&v] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            v.push_back(3);
+        });
+        woken = v.wait_for_change(version, std::chrono::seconds(10));
+        writer.join();
+        CHECK(woken != version && v.read_only_copy().size() == 3);
+    }
+
+    void test_subscribe()
+    {
+        cow::vector<int> v;
+        std::vector<std::size_t> seen;
+        {
+            cow::subscription s = v.subscribe([&](std::size_t version) { seen.push_back(version); });
+            v.push_back(1);
+            v.push_back(2);
+            CHECK(seen.size() == 2 && seen.back() == v.version());
+        }
+        v.push_back(3); // unsubscribed on destruction
+        CHECK(seen.size() == 2);
+
+        cow::subscription s = v.subscribe([&](std::size_t version) { seen.push_back(version); });
+        std::thread([&v] { v.push_back(4); }).join(); // called on the writer's thread
+        CHECK(seen.size() == 3 && seen.back() == v.version());
+        s.reset();
+        v.push_back(5);
+        CHECK(seen.size() == 3);
+
+        // the callback may cancel its own subscription
+        int calls = 0;
+        cow::subscription once;
+        once = v.subscribe([&](std::size_t) { ++calls; once.reset(); });
+        v.push_back(6);
+        v.push_back(7);
+        CHECK(calls == 1);
+    }
+
+    void test_update_at()
+    {
+        cow::vector<int> v = numbers(5);
+        CHECK(v.update_at(1, [](int& x) { x = 10; }) == cow::write_result::in_place);
+
+        auto before = v.read_only_copy();
+        CHECK(v.update_at(2, [](int& x) { x = 20; }) == cow::write_result::copied);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 0, 10, 20, 3, 4 }));
+        CHECK(elements(before) == std::vector<int>({ 0, 10, 2, 3, 4 })); // the snapshot keeps its value
+
+        std::size_t version = v.version();
+        CHECK_THROWS(v.update_at(5, [](int& x) { x = 50; }), std::out_of_range);
+        // a throwing func changes nothing on the copy path, even after it has written the element
+        before = v.read_only_copy();
+        CHECK_THROWS(v.update_at(0, [](int& x) { x = -1; throw std::runtime_error("update failed"); }), std::runtime_error);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 0, 10, 20, 3, 4 }) && v.version() == version);
+
+        before = cow::vector<int>().read_only_copy(); // in place from now on
+        CHECK_THROWS(v.update_at(0, [](int&) { throw std::runtime_error("update failed"); }), std::runtime_error);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 0, 10, 20, 3, 4 }) && v.version() == version);
+    }
+
+    void test_replace_if()
+    {
+        cow::vector<int> v = numbers(6);
+        CHECK(v.replace_if([](int x) { return x % 2 == 0; }, -1) == 3); // in place
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ -1, 1, -1, 3, -1, 5 }));
+
+        auto before = v.read_only_copy();
+        std::size_t version = v.version();
+        CHECK(v.replace_if([](int x) { return x > 100; }, 0) == 0 && v.version() == version); // nothing is published
+        CHECK(v.replace_if([](int x) { return x == 3 || x == 5; }, 0) == 2); // on a copy
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ -1, 1, -1, 0, -1, 0 }));
+        CHECK(elements(before) == std::vector<int>({ -1, 1, -1, 3, -1, 5 }));
+
+        // a throwing predicate changes nothing on the copy path, even after a match
+        version = v.version();
+        before = v.read_only_copy();
+        auto failing = [](int x) -> bool { if (x == 0) throw std::runtime_error("predicate failed"); return x == 1; };
+        CHECK_THROWS(v.replace_if(failing, 7), std::runtime_error);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ -1, 1, -1, 0, -1, 0 }) && v.version() == version);
+
+        before = cow::vector<int>().read_only_copy(); // in place: it throws before the first match
+        CHECK_THROWS(v.replace_if([](int) -> bool { throw std::runtime_error("predicate failed"); }, 7), std::runtime_error);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ -1, 1, -1, 0, -1, 0 }) && v.version() == version);
+    }
+
+    void test_mutate()
+    {
+        cow::vector<int> v = numbers(3);
+        CHECK(v.mutate([](std::vector<int>& storage) { storage.push_back(3); }) == cow::write_result::in_place);
+
+        auto before = v.read_only_copy();
+        CHECK(v.mutate([](std::vector<int>& storage) { storage[0] = 10; storage.pop_back(); }) == cow::write_result::copied);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 10, 1, 2 }));
+        CHECK(elements(before) == std::vector<int>({ 0, 1, 2, 3 }));
+
+        // a func which throws on the copy path leaves the vector unchanged, whatever it has done
+        before = v.read_only_copy();
+        std::size_t version = v.version();
+        CHECK_THROWS(v.mutate([](std::vector<int>& storage) { storage.clear(); storage.push_back(-1); throw std::runtime_error("mutate failed"); }), std::runtime_error);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 10, 1, 2 }) && v.version() == version);
+
+        CHECK(v.mutate([](std::vector<int>& storage) { storage.clear(); }) == cow::write_result::copied);
+        CHECK(v.read_only_copy().empty() && before.size() == 3);
+    }
+
+    template <typename TGrowth>
+    using growing_vector = cow::vector<int, std::mutex, std::lock_guard<std::mutex>, std::allocator<int>, cow::locked_reads, TGrowth>;
+
+    // Capacity of the copy made by a push_back while a read-only copy of size elements is held
+    template <typename TGrowth>
+    std::size_t capacity_after_copy(int size)
+    {
+        growing_vector<TGrowth> v;
+        for (int i = 0; i < size; ++i)
+            v.push_back(i);
+        auto held = v.read_only_copy();
+        v.push_back(size);
+        return v.capacity();
+    }
+
+    void test_capacity()
+    {
+        cow::vector<int> v;
+        CHECK(v.capacity() == 0);
+        v.reserve(0);
+        CHECK(v.capacity() == 0 && v.read_only_copy().empty());
+        v.reserve(100);
+        CHECK(v.capacity() >= 100 && v.read_only_copy().empty());
+        for (int i = 0; i < 100; ++i)
+            v.push_back(i);
+        CHECK(v.capacity() >= 100);
+
+        auto held = v.read_only_copy();
+        v.reserve(200); // on a copy
+        CHECK(v.capacity() >= 200 && held.size() == 100 && elements(v.read_only_copy()) == elements(held));
+        v.shrink_to_fit(); // on a copy
+        CHECK(v.capacity() == 100 && elements(v.read_only_copy()) == elements(held));
+        v.reserve(10); // never shrinks
+        CHECK(v.capacity() == 100);
+
+        v.clear();
+        v.push_back(1);
+        v.reserve(50);
+        v.shrink_to_fit(); // in place
+        CHECK(v.capacity() == 1);
+
+        // capacity of a copy is chosen by the growth policy
+        CHECK(capacity_after_copy<cow::geometric_growth<>>(10) == 16); // 11 * 3 / 2
+        CHECK(capacity_after_copy<cow::geometric_growth<>>(0) == 4); // Min
+        CHECK((capacity_after_copy<cow::geometric_growth<2, 1, 1>>(10) == 22));
+        CHECK(capacity_after_copy<cow::fixed_growth<8>>(10) == 19);
+        CHECK(capacity_after_copy<cow::exact_growth>(10) == 11);
+    }
+
+    // Element which counts its copies, moves aren't counted
+    struct counted_copy
+    {
+        static int copies;
+
+        explicit counted_copy(int v) : value(v) {}
+        counted_copy(const counted_copy& copy) : value(copy.value) { ++copies; }
+        counted_copy(counted_copy&& right) noexcept : value(right.value) { right.value = -1; }
+        counted_copy& operator=(const counted_copy& right) { value = right.value; ++copies; return *this; }
+        counted_copy& operator=(counted_copy&& right) noexcept { value = right.value; right.value = -1; return *this; }
+
+        int value;
+    };
+
+    int counted_copy::copies = 0;
+
+    void test_insert_append()
+    {
+        cow::vector<int> v = numbers(3);
+        std::vector<int> more = { 10, 11 };
+        CHECK(v.insert(0, more.begin(), more.begin() + 1) == cow::write_result::in_place);
+        CHECK(v.insert(4, more.begin(), more.end()) == cow::write_result::in_place); // at the end
+        auto held = v.read_only_copy();
+        CHECK(v.insert(2, more.begin(), more.end()) == cow::write_result::copied);
+        CHECK(elements(v.read_only_copy()) == std::vector<int>({ 10, 0, 10, 11, 1, 2, 10, 11 }));
+        CHECK(elements(held) == std::vector<int>({ 10, 0, 1, 2, 10, 11 }));
+        CHECK(v.insert(3, more.begin(), more.begin()) == cow::write_result::in_place); // nothing to insert
+
+        std::size_t version = v.version();
+        CHECK_THROWS(v.insert(9, more.begin(), more.end()), std::out_of_range);
+        CHECK(v.read_only_copy().size() == 8 && v.version() == version);
+
+        // appending its own snapshot doubles the vector
+        cow::vector<int> self = numbers(3);
+        self.append(self.read_only_copy());
+        CHECK(elements(self.read_only_copy()) == std::vector<int>({ 0, 1, 2, 0, 1, 2 }));
+
+        // rvalues are moved, on the copy path only the elements already there are copied
+        cow::vector<counted_copy> moved;
+        moved.reserve(4);
+        counted_copy::copies = 0;
+        counted_copy element(1);
+        moved.push_back(std::move(element));
+        CHECK(counted_copy::copies == 0 && element.value == -1);
+        auto snapshot = moved.read_only_copy();
+        moved.push_back(counted_copy(2));
+        CHECK(counted_copy::copies == 1 && moved.read_only_copy().size() == 2 && snapshot.size() == 1);
+
+        std::vector<counted_copy> range;
+        range.emplace_back(3);
+        range.emplace_back(4);
+        snapshot = moved.read_only_copy();
+        moved.append(std::move(range));
+        CHECK(counted_copy::copies == 3 && moved.read_only_copy()[3].value == 4);
+    }
+
+    void test_cached_reader()
+    {
+        cow::vector<int> v;
+        std::size_t version = v.version();
+        v.push_back(1);
+        CHECK(v.version() != version);
+        version = v.version();
+        CHECK(v.remove([](int x) { return x > 100; }) == 0 && v.version() == version); // nothing changed
+
+        cow::cached_reader<cow::vector<int>> reader(v);
+        auto first = reader.get().begin();
+        CHECK(reader->size() == 1 && reader.get().begin() == first); // unchanged, the same copy
+        v.push_back(2);
+        CHECK(reader->size() == 2 && (*reader)[1] == 2); // refreshed after the write
+        v.mutate([](std::vector<int>& storage) { storage[0] = 10; });
+        CHECK(elements(*reader) == std::vector<int>({ 10, 2 }));
+        v.clear();
+        CHECK(reader->empty());
+    }
+
+    void test_sharded_vector()
+    {
+        cow::sharded_vector<int, 5> v;
+        CHECK(v.read_only_copy().empty() && v.read_only_copy().begin() == v.read_only_copy().end());
+
+        // shards 0, 2 and 4 stay empty, flat indexes skip them
+        v.shard(1).push_back(10);
+        v.shard(1).push_back(11);
+        v.shard(3).push_back(30);
+        auto copy = v.read_only_copy();
+        CHECK(copy.size() == 3 && copy[0] == 10 && copy[1] == 11 && copy[2] == 30);
+        CHECK(copy.front() == 10 && copy.back() == 30 && copy.at(2) == 30);
+        CHECK_THROWS(copy.at(3), std::out_of_range);
+        CHECK(elements(copy) == std::vector<int>({ 10, 11, 30 }));
+
+        v.shard(4).push_back(40);
+        v.push_back(50); // to the shard of this thread
+        CHECK(copy.size() == 3); // copies don't change
+        copy = v.read_only_copy();
+        CHECK(copy.size() == 5);
+        for (std::size_t i = 0; i < copy.size(); ++i) // indexes agree with the iterator
+            CHECK(copy[i] == *std::next(copy.begin(), std::ptrdiff_t(i)));
+
+        CHECK(v.remove([](int x) { return x == 10 || x == 30; }) == 2);
+        copy = v.read_only_copy();
+        CHECK(copy.size() == 3 && copy[0] == 11);
+        v.clear();
+        CHECK(v.read_only_copy().empty());
+    }
+
+#if !defined(_WIN32)
+    struct record
+    {
+        int id;
+        double value;
+    };
+
+    template <typename TCopy>
+    std::vector<int> ids(const TCopy& copy)
+    {
+        std::vector<int> result;
+        for (const record& r : copy)
+            result.push_back(r.id);
+        return result;
+    }
+
+    void test_shared_vector()
+    {
+        const std::string name = "/cow_test_" + std::to_string(::getpid());
+        cow::mapped_region::unlink_shared(name);
+
+        CHECK_THROWS(cow::mapped_region::open_shared(name), std::system_error);
+        CHECK_THROWS(cow::shared_vector<record>(cow::mapped_region::create_shared(name + "_small", 8)), std::invalid_argument);
+        cow::mapped_region::unlink_shared(name + "_small");
+
+        std::unique_ptr<cow::shared_vector<record>::readonly_vector> outliving;
+        {
+            cow::shared_vector<record> v(cow::mapped_region::create_shared(name, 64 * 1024));
+            CHECK_THROWS(cow::mapped_region::create_shared(name, 64 * 1024), std::system_error); // it exists
+            CHECK_THROWS(cow::shared_vector<int>(cow::mapped_region::open_shared(name)), std::invalid_argument); // another layout
+
+            for (int i = 0; i < 10; ++i)
+                v.push_back(record{ i, i * 0.5 });
+            record more[] = { { 10, 5 }, { 11, 5.5 } };
+            v.append(more, 2);
+            CHECK(v.read_only_copy().size() == 12 && v.read_only_copy().at(11).value == 5.5);
+            CHECK_THROWS(v.read_only_copy().at(12), std::out_of_range);
+
+            auto copy = v.read_only_copy();
+            CHECK(v.remove([](const record& r) { return r.id % 2 != 0; }) == 6);
+            CHECK(v.remove([](const record& r) { return r.id > 100; }) == 0);
+            CHECK(copy.size() == 12 && ids(v.read_only_copy()) == std::vector<int>({ 0, 2, 4, 6, 8, 10 }));
+
+            // a write which doesn't fit into the region throws and leaves the content as it was
+            std::vector<record> huge(64 * 1024);
+            CHECK_THROWS(v.assign(huge.data(), huge.size()), std::bad_alloc);
+            CHECK(v.read_only_copy().size() == 6);
+
+            // storages released by copies are reused, so writes with copies never fill the region
+            for (int i = 0; i < 1000; ++i)
+            {
+                auto pinned = v.read_only_copy();
+                v.push_back(record{ 100 + i, 0 });
+                v.remove([i](const record& r) { return r.id == 100 + i; });
+            }
+            CHECK(ids(v.read_only_copy()) == std::vector<int>({ 0, 2, 4, 6, 8, 10 }));
+
+            // another process sees the writes, a writer which dies under lock doesn't block the others
+            pid_t child = ::fork();
+            if (child == 0)
+            {
+                cow::shared_vector<record> reader(cow::mapped_region::open_shared(name));
+                if (reader.read_only_copy().size() != 6)
+                    ::_exit(1);
+                reader.remove([](const record& r) { if (r.id == 4) ::_exit(2); return false; });
+                ::_exit(0);
+            }
+
+            int status = 0;
+            ::waitpid(child, &status, 0);
+            CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 2);
+            v.push_back(record{ 12, 6 });
+            CHECK(v.read_only_copy().size() == 7);
+
+            outliving.reset(new cow::shared_vector<record>::readonly_vector(v.read_only_copy()));
+            v.clear();
+            CHECK(v.read_only_copy().empty());
+        }
+
+        // a copy keeps the region mapped after shared_vector is destroyed
+        CHECK(outliving->size() == 7 && outliving->back().id == 12);
+        outliving.reset();
+
+        cow::mapped_region::unlink_shared(name);
+    }
+
+    void write_file(const std::string& path, const std::string& content)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(content.data(), std::streamsize(content.size()));
+    }
+
+    std::string read_file(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    void test_save_load()
+    {
+        const std::string path = "/tmp/cow_test_" + std::to_string(::getpid()) + ".snapshot";
+
+        cow::vector<record> v;
+        for (int i = 0; i < 100; ++i)
+            v.push_back(record{ i, i * 0.25 });
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            cow::save(v.read_only_copy(), out);
+        }
+
+        cow::mapped_snapshot<record> snapshot = cow::load_mapped<record>(path);
+        CHECK(snapshot.size() == 100 && snapshot.at(99).value == 99 * 0.25 && ids(snapshot) == ids(v.read_only_copy()));
+        CHECK_THROWS(snapshot.at(100), std::out_of_range);
+
+        cow::vector<record> loaded;
+        loaded.push_back(record{ -1, 0 });
+        cow::load(loaded, path);
+        CHECK(ids(loaded.read_only_copy()) == ids(v.read_only_copy()));
+
+        // an empty copy gives an empty snapshot
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            cow::save(cow::vector<record>().read_only_copy(), out);
+        }
+        cow::load(loaded, path);
+        CHECK(cow::load_mapped<record>(path).empty() && loaded.read_only_copy().empty());
+
+        // bad files throw and leave the vector as it was
+        loaded.push_back(record{ 7, 0 });
+        CHECK_THROWS(cow::load(loaded, path + ".missing"), std::system_error);
+
+        write_file(path, "");
+        CHECK_THROWS(cow::load(loaded, path), std::runtime_error);
+        write_file(path, "not a snapshot file, but long enough to have a header of 64 bytes.");
+        CHECK_THROWS(cow::load(loaded, path), std::runtime_error);
+
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            cow::save(v.read_only_copy(), out);
+        }
+        std::string good = read_file(path);
+        write_file(path, good.substr(0, 40)); // short header
+        CHECK_THROWS(cow::load(loaded, path), std::runtime_error);
+        write_file(path, good.substr(0, good.size() - 1)); // the last record is cut
+        CHECK_THROWS(cow::load(loaded, path), std::runtime_error);
+        write_file(path, good);
+        CHECK_THROWS(cow::load_mapped<int>(path), std::runtime_error); // records of another size
+
+        std::string other_format = good;
+        other_format[8] = 2;
+        write_file(path, other_format);
+        CHECK_THROWS(cow::load_mapped<record>(path), std::runtime_error);
+        CHECK(ids(loaded.read_only_copy()) == std::vector<int>({ 7 }));
+
+        std::ofstream failed; // not open
+        CHECK_THROWS(cow::save(v.read_only_copy(), failed), std::runtime_error);
+
+        std::remove(path.c_str());
+    }
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+        filter = argv[1];
+
+    run("sorted_vector", test_sorted_vector);
+    run("unordered_map", test_unordered_map);
+    run("async_writer", test_async_writer);
+    run("small_vector", test_small_vector);
+    run("tracked_vector", test_tracked_vector);
+    run("replicated_reads", test_replicated_reads);
+    run("remove_indices", test_remove_indices);
+    run("remove_if_sorted", test_remove_if_sorted);
+    run("wait_for_change", test_wait_for_change);
+    run("subscribe", test_subscribe);
+    run("update_at", test_update_at);
+    run("replace_if", test_replace_if);
+    run("mutate", test_mutate);
+    run("capacity", test_capacity);
+    run("insert_append", test_insert_append);
+    run("cached_reader", test_cached_reader);
+    run("sharded_vector", test_sharded_vector);
+#if !defined(_WIN32)
+    run("shared_vector", test_shared_vector);
+    run("save_load", test_save_load);
+#endif
+
+    return failures ? 1 : 0;
+}